@@ -0,0 +1,155 @@
+//
+// Allocators for the bucket arrays of CuckoohashingTable. Both follow the
+// standard allocator interface, so any std-style allocator can be used instead.
+//
+
+#ifndef CONCURRENTLIB_ALLOCATORS_H
+#define CONCURRENTLIB_ALLOCATORS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace concurrent_lib {
+
+// Memory aligned to a cache line, or more if T needs it.
+template <typename T>
+class CacheAlignedAllocator {
+ public:
+  typedef T value_type;
+
+  CacheAlignedAllocator() {}
+
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    void* memory = nullptr;
+    const size_t align = alignof(T) > 64 ? alignof(T) : 64;
+    if (posix_memalign(&memory, align, n == 0 ? align : n * sizeof(T)) != 0) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(memory);
+  }
+
+  void deallocate(T* p, size_t) {
+    free(p);
+  }
+};
+
+template <typename T, typename U>
+inline bool operator==(const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const CacheAlignedAllocator<T>&, const CacheAlignedAllocator<U>&) {
+  return false;
+}
+
+/*
+ * HugePageAllocator backs large allocations with huge pages, so a table of
+ * many gigabytes needs a few thousand TLB entries instead of millions of them.
+ * Allocations of at least HUGE_PAGE_SIZE are mapped with mmap: first with
+ * explicit huge pages, 1 GB ones for multiples of 1 GB, which only works if
+ * the administrator reserved them, then as normal pages aligned to 2 MB and
+ * advised MADV_HUGEPAGE, so transparent huge pages back them. Smaller
+ * allocations, and all of them outside Linux, come from CacheAlignedAllocator.
+ */
+template <typename T>
+class HugePageAllocator {
+ public:
+  typedef T value_type;
+
+  static const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+  static const size_t GIGANTIC_PAGE_SIZE = size_t(1) << 30;
+
+  HugePageAllocator() {}
+
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    const size_t bytes = n * sizeof(T);
+#if defined(__linux__)
+    if (bytes >= HUGE_PAGE_SIZE) {
+      return static_cast<T*>(MapHugePages(RoundUp(bytes)));
+    }
+#endif
+    return CacheAlignedAllocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    const size_t bytes = n * sizeof(T);
+#if defined(__linux__)
+    if (bytes >= HUGE_PAGE_SIZE) {
+      munmap(p, RoundUp(bytes));
+      return;
+    }
+#endif
+    CacheAlignedAllocator<T>().deallocate(p, n);
+  }
+
+ private:
+  static inline size_t RoundUp(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  }
+
+#if defined(__linux__)
+  static void* MapHugePages(size_t bytes) {
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* memory;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    if (bytes % GIGANTIC_PAGE_SIZE == 0) {
+      memory = mmap(nullptr, bytes, prot, flags | MAP_HUGETLB | (30 << MAP_HUGE_SHIFT), -1, 0);
+      if (memory != MAP_FAILED) {
+        return memory;
+      }
+    }
+    memory = mmap(nullptr, bytes, prot, flags | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+    if (memory != MAP_FAILED) {
+      return memory;
+    }
+#endif
+
+    // Map one huge page more and trim it, transparent huge pages only back
+    // ranges aligned to their size.
+    memory = mmap(nullptr, bytes + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(memory);
+    const uintptr_t aligned = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    if (aligned != begin) {
+      munmap(memory, aligned - begin);
+    }
+    if (aligned + bytes != begin + bytes + HUGE_PAGE_SIZE) {
+      munmap(reinterpret_cast<void*>(aligned + bytes), begin + HUGE_PAGE_SIZE - aligned);
+    }
+#if defined(MADV_HUGEPAGE)
+    madvise(reinterpret_cast<void*>(aligned), bytes, MADV_HUGEPAGE);
+#endif
+    return reinterpret_cast<void*>(aligned);
+  }
+#endif
+};
+
+template <typename T, typename U>
+inline bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return false;
+}
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_ALLOCATORS_H
@@ -6,49 +6,534 @@
 #define CONCURRENTLIB_CUCOOHASHINGTABLE_H
 
 #include <array>
+#include <cstdint>
 #include <vector>
 #include <functional>
 #include <utility>
-#include <bitset>
+#include <cstring>
+#include <cstdlib>
+#include <new>
 #include <mutex>
 #include <atomic>
 #include <memory>
-#include <queue>
+#include <iterator>
+#include <thread>
+#include <type_traits>
 
-#define BUCKET_SIZE 4
-#define BUCKET_NUM  512
-#define CACHE_LINE_SIZE 64
-#define MAX_STEP 128
+#include "Allocators.h"
+#include "Locks.h"
+#include "Numa.h"
+#include "Optional.h"
+#include "SlabPool.h"
+#include "TagMatch.h"
 
 namespace concurrent_lib {
 
+/*
+ * SLOT_PER_BUCKET is the associativity of buckets, between 1 and 16. Wider
+ * buckets reach a higher load factor before resizing and suit small keys,
+ * narrower ones touch less memory per lookup and suit large values.
+ * LockType is the lock of a bucket lock stripe, one of the policies in Locks.h.
+ * ElidedSpinlock runs the critical sections of lookups, inserts,
+ * displacements and erases as hardware transactions on CPUs with RTM, and
+ * lookups always lock then.
+ * TagType is the partial key kept per slot, uint8_t or uint16_t. A lookup
+ * compares full keys only when tags match, 16-bit tags make a false match 256
+ * times less likely at the cost of one more byte per slot.
+ * OUT_OF_LINE_VALUES keeps values in a slab pool of the table and only a
+ * pointer to them in cells, for large values: buckets stay dense and cuckoo
+ * moves copy a pointer instead of the value. Such values are read under
+ * shared locks, never optimistically.
+ * Allocator is a standard allocator for the bucket arrays and lock stripes, it
+ * is rebound to the types it allocates and has to honor their cache line
+ * alignment. NumaAllocator places them on NUMA nodes.
+ * HugePageAllocator backs large tables with huge pages to cut TLB misses.
+ * COMPACT_CELLS stores the keys of a bucket in one array and its values in
+ * another instead of an array of pairs, so a 4 byte key with an 8 byte value
+ * takes 12 bytes instead of 16. Keys and values must then be trivially
+ * copyable and at most 8 bytes, with OUT_OF_LINE_VALUES only the keys are
+ * checked since cells hold pointers to the values.
+ */
 template <typename KeyType,
           typename ValueType,
           class KeyHahser = std::hash<KeyType>,
-          class KeyEqualChekcer = std::equal_to<KeyType>>
+          class KeyEqualChekcer = std::equal_to<KeyType>,
+          size_t SLOT_PER_BUCKET = 4,
+          class LockType = BackoffSpinlock,
+          typename TagType = uint8_t,
+          bool OUT_OF_LINE_VALUES = false,
+          class Allocator = CacheAlignedAllocator<char>,
+          bool COMPACT_CELLS = false>
 class CuckoohashingTable {
+  static_assert(SLOT_PER_BUCKET >= 1 && SLOT_PER_BUCKET <= 16,
+                "a bucket should have between 1 and 16 slots");
+  static_assert(std::is_same<TagType, uint8_t>::value || std::is_same<TagType, uint16_t>::value,
+                "partial keys should be uint8_t or uint16_t");
+
+ public:
+  static constexpr size_t BUCKET_SIZE = SLOT_PER_BUCKET;
+  // max number of cuckoo moves in one insert if not given to the constructor.
+  static constexpr size_t DEFAULT_MAX_STEP = 5;
+  // max step is capped by the size of the per-thread cuckoo path.
+  static constexpr size_t MAX_STEP_LIMIT = 16;
+
+ private:
+  // buckets of the table if no initial capacity is given.
+  static constexpr size_t DEFAULT_BUCKET_NUM = 512;
+  // lock stripes per hardware thread, the lock table grows with the table
+  // until it reaches this many stripes per thread.
+  static constexpr size_t STRIPES_PER_THREAD = 64;
+  static constexpr size_t CACHE_LINE_SIZE = 64;
+  // capacity of the per-thread breadth first search frontier.
+  static constexpr size_t MAX_BFS_QUEUE_SIZE = 512;
+  // counters tracking threads that read buckets without locks, per hardware
+  // thread, so that live threads rarely share one.
+  static constexpr size_t READER_SLOTS_PER_THREAD = 2;
+  // old buckets migrated by every operation in incremental migration mode.
+  static constexpr size_t MIGRATE_BUCKETS_PER_OP = 8;
+  // optimistic reads tried before a lookup falls back to taking locks.
+  static constexpr size_t OPTIMISTIC_READ_RETRY = 8;
+  // keys of a batch whose buckets are prefetched before any of them is processed.
+  static constexpr size_t PREFETCH_GROUP_SIZE = 16;
+
+  typedef std::integral_constant<bool, OUT_OF_LINE_VALUES> OutOfLineValues;
+  // what a cell holds for its value.
+  typedef typename std::conditional<OUT_OF_LINE_VALUES, ValueType*, ValueType>::type StoredValue;
+  typedef std::pair<KeyType, StoredValue> Cell;
+  typedef std::integral_constant<bool, COMPACT_CELLS> CompactCells;
+  static_assert(!COMPACT_CELLS ||
+                (std::is_trivially_copyable<KeyType>::value && sizeof(KeyType) <= 8 &&
+                 std::is_trivially_copyable<StoredValue>::value && sizeof(StoredValue) <= 8),
+                "compact cells need trivially copyable keys and values of at most 8 bytes");
+  // buckets visited under one lock acquisition by ParallelForEach.
+  static constexpr size_t SCAN_CHUNK_SIZE = 64;
+
+  class LockTable;
+
  public:
-  CuckoohashingTable():table_(BUCKET_NUM) {
-    //TODO: resize the lock
-    // locks_.resize(BUCKET_NUM);
+  /*
+   * How old buckets are moved to the new table after a resize.
+   * EAGER: the resizing thread migrates all of them before its insert returns.
+   * INCREMENTAL: every following Insert and Lookup migrates a few of them, and
+   * the old buckets are freed when the last one is done. Nobody pays for a whole
+   * table copy, which keeps latency flat while the table grows.
+   */
+  enum MigrationMode {
+    EAGER,
+    INCREMENTAL
+  };
+
+  /*
+   * initialCapacity is the number of keys the table holds before its first
+   * resize, rounded up to a power of two buckets. maxStep bounds the cuckoo moves of an insert before the table
+   * grows instead, it is capped at MAX_STEP_LIMIT.
+   */
+  explicit CuckoohashingTable(MigrationMode migrationMode = EAGER,
+                              size_t initialCapacity = DEFAULT_BUCKET_NUM * SLOT_PER_BUCKET,
+                              size_t maxStep = DEFAULT_MAX_STEP,
+                              const Allocator& allocator = Allocator())
+  :table_(InitialSizeBase(initialCapacity), allocator), migrationMode_(migrationMode),
+   maxStep_(maxStep < MAX_STEP_LIMIT ? maxStep : MAX_STEP_LIMIT),
+   maxLockSizeBase_(MaxLockSizeBase()), readerSlots_(ReaderSlotNum(), ReaderSlotAllocator(allocator)) {
+    const size_t tableSizeBase = table_.GetTableSizeBase();
+    locks_.store(new LockTable(tableSizeBase < maxLockSizeBase_ ? tableSizeBase : maxLockSizeBase_, allocator));
+  }
+
+  ~CuckoohashingTable() {
+    delete locks_.load();
   }
-  ~CuckoohashingTable() {}
 
   bool Lookup(const KeyType& key) {
-      return CuckooLookupLoop(key);
+      return CuckooLookupLoop(GetHashValue(key), key, [](const ValueType&) {});
+  }
+
+  // Copy the value of key to value, return false if key is not found.
+  bool Find(const KeyType& key, ValueType& value) {
+    return CuckooLookupLoop(GetHashValue(key), key, [&value](const ValueType& found) {
+      value = found;
+    });
+  }
+
+  // Return a copy of the value of key, which is empty if key is not found.
+  Optional<ValueType> Find(const KeyType& key) {
+    Optional<ValueType> result;
+    CuckooLookupLoop(GetHashValue(key), key, [&result](const ValueType& found) {
+      result.Emplace(found);
+    });
+    return result;
+  }
+
+  ValueType FindOrDefault(const KeyType& key, const ValueType& defaultValue) {
+    ValueType value = defaultValue;
+    Find(key, value);
+    return value;
+  }
+
+  // Call fn(const ValueType&) on the value of key while its bucket is locked
+  // in shared mode, so the value is not copied. Other readers may run fn on
+  // the same value at the same time. fn should be short and must not call
+  // back into the table. Return false if key is not found.
+  template <typename Fn>
+  bool FindFn(const KeyType& key, Fn fn) {
+    MigrateStep();
+    return CuckooLockedLookup(GetHashValue(key), key, fn);
+  }
+
+  /*
+   * Batched versions of Lookup, Find and Insert. Keys are hashed and their
+   * buckets and lock stripes prefetched a group at a time, so the cache misses
+   * of a group overlap instead of being paid one key after another. Each key
+   * is still processed as a single operation, a batch is not atomic.
+   * found[i] (and values[i] for FindBatch) is set for every key, return the
+   * number of keys found.
+   */
+  size_t LookupBatch(const KeyType* keys, size_t count, bool* found) {
+    return CuckooLookupBatch(keys, count, found, [](size_t, const ValueType&) {});
+  }
+
+  size_t FindBatch(const KeyType* keys, size_t count, ValueType* values, bool* found) {
+    return CuckooLookupBatch(keys, count, found, [values](size_t i, const ValueType& value) {
+      values[i] = value;
+    });
   }
 
   // return true is inserting succeed.
   // return false is finding a duplicate value.
   // passing in rvalue.
   bool Insert(KeyType&& key, ValueType&& value) {
-    return CuckooInsertLoop(key, value);
+    return CuckooInsertLoop(GetHashValue(key), std::forward<KeyType>(key), std::forward<ValueType>(value));
+  }
+
+  // Move keys[i] and values[i] into the table, keys and values already in the
+  // table are left untouched. inserted[i] tells if key i is inserted, it can be
+  // nullptr. return the number of inserted keys.
+  size_t InsertBatch(KeyType* keys, ValueType* values, size_t count, bool* inserted = nullptr) {
+    size_t hashValues[PREFETCH_GROUP_SIZE];
+    size_t insertedNum = 0;
+    for (size_t begin = 0; begin < count; begin += PREFETCH_GROUP_SIZE) {
+      const size_t end = begin + PREFETCH_GROUP_SIZE < count ? begin + PREFETCH_GROUP_SIZE : count;
+      PrefetchGroup(keys, begin, end, hashValues, true);
+      for (size_t i = begin; i < end; i++) {
+        bool done = CuckooInsertLoop(hashValues[i - begin], std::move(keys[i]), std::move(values[i]));
+        insertedNum += done;
+        if (inserted != nullptr) {
+          inserted[i] = done;
+        }
+      }
+    }
+    return insertedNum;
   }
 
+  // Replace the value of key, return false if key is not found.
+  bool Update(const KeyType& key, ValueType&& value) {
+    return UpdateFn(key, [&value](ValueType& stored) {
+      stored = std::move(value);
+    });
+  }
+
+  // Call fn(ValueType&) to modify the value of key in place, with the bucket
+  // locked. return false if key is not found.
+  template <typename Fn>
+  bool UpdateFn(const KeyType& key, Fn fn) {
+    return CuckooUpdateLoop(key, fn);
+  }
+
+  // If key exists, call fn(ValueType&) on its value, otherwise insert key with
+  // defaultValue. The check and the change are done under the same locks.
+  // return true if key is inserted.
+  template <typename Fn>
+  bool Upsert(KeyType&& key, Fn fn, ValueType&& defaultValue) {
+    return CuckooUpsertLoop(std::forward<KeyType>(key), fn,
+                            std::forward<ValueType>(defaultValue));
+  }
+
+  // return true if key is found and erased.
+  bool Erase(const KeyType& key) {
+    return CuckooEraseLoop(key, [](const ValueType&) { return true; });
+  }
+
+  // Erase key only if pred(const ValueType&) returns true, pred is called with
+  // the bucket locked. return true if key is found and erased.
+  template <typename Pred>
+  bool EraseFn(const KeyType& key, Pred pred) {
+    return CuckooEraseLoop(key, pred);
+  }
+
+  // number of keys in the table, exact when no writer runs meanwhile.
   size_t Size() {
+    size_t entries = 0;
+    for (const auto& slot : readerSlots_) {
+      entries += slot.entries.load(std::memory_order_relaxed);
+    }
+    // an erase counted before the insert of its key was read counts -1.
+    return static_cast<std::ptrdiff_t>(entries) < 0 ? 0 : entries;
+  }
+
+  size_t BucketCount() {
     return table_.GetTableSize();
   }
 
+  // Memory of a table, in bytes unless noted.
+  struct TableStats {
+    size_t entryNum;
+    size_t bucketNum;
+    size_t slotNum;
+    // entryNum / slotNum.
+    double loadFactor;
+    // bucket metadata and cells, with old buckets of a pending migration.
+    size_t bucketBytes;
+    // lock stripes, with the smaller lock tables kept for optimistic readers.
+    size_t lockBytes;
+    // slabs of out of line values.
+    size_t valueBytes;
+    // per-thread reader and entry counters.
+    size_t readerBytes;
+    // all of the above and the table object itself.
+    size_t totalBytes;
+  };
+
+  // Waits for a running resize, counts may be off while writers run.
+  TableStats Stats() {
+    std::lock_guard<std::mutex> resizeGuard(resizeLock_);
+    TableStats stats;
+    stats.entryNum = Size();
+    stats.bucketNum = table_.GetTableSize();
+    stats.slotNum = stats.bucketNum * BUCKET_SIZE;
+    stats.loadFactor = static_cast<double>(stats.entryNum) / stats.slotNum;
+    stats.bucketBytes = table_.GetBytes();
+    stats.lockBytes = locks_.load(std::memory_order_relaxed)->GetBytes();
+    for (const auto& lockTable : retiredLocks_) {
+      stats.lockBytes += lockTable->GetBytes();
+    }
+    stats.valueBytes = ValuePoolBytes(OutOfLineValues());
+    stats.readerBytes = readerSlots_.size() * sizeof(ReaderSlot);
+    stats.totalBytes = sizeof(*this) + stats.bucketBytes + stats.lockBytes + stats.valueBytes +
+                       stats.readerBytes;
+    return stats;
+  }
+
+  size_t MemoryUsage() {
+    return Stats().totalBytes;
+  }
+
+  /*
+   * LockedTable holds every bucket lock of a table until it is destroyed or
+   * Unlock() is called, so bulk scans see a consistent table. Other threads
+   * block meanwhile, and the thread holding it must not call the table itself.
+   * A pending incremental migration is finished before the locks are taken.
+   */
+  class LockedTable {
+   public:
+    typedef std::pair<const KeyType, ValueType> value_type;
+
+    // Forward iterator over occupied cells. It yields a pair of a const
+    // reference to the key and a reference to the value, cells are not pairs
+    // with compact cells or out of line values, and a key changed in place
+    // would be in the wrong bucket.
+    class iterator {
+     public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef typename LockedTable::value_type value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef std::pair<const KeyType&, ValueType&> reference;
+
+      struct ArrowProxy {
+        reference cell;
+
+        reference* operator->() {
+          return &cell;
+        }
+      };
+      typedef ArrowProxy pointer;
+
+      iterator(): map_(nullptr), index_(0), slot_(0) {}
+
+      reference operator*() const {
+        const Bucket bucket = map_->table_.GetBucket(index_);
+        return reference(bucket.GetKey(slot_), bucket.GetValue(slot_));
+      }
+
+      pointer operator->() const {
+        return ArrowProxy{**this};
+      }
+
+      iterator& operator++() {
+        slot_++;
+        SkipFreeSlots();
+        return *this;
+      }
+
+      iterator operator++(int) {
+        iterator old = *this;
+        ++*this;
+        return old;
+      }
+
+      bool operator==(const iterator& other) const {
+        return index_ == other.index_ && slot_ == other.slot_;
+      }
+
+      bool operator!=(const iterator& other) const {
+        return !(*this == other);
+      }
+
+     private:
+      friend class LockedTable;
+
+      iterator(CuckoohashingTable* map, size_t index, size_t slot)
+      : map_(map), index_(index), slot_(slot) {
+        SkipFreeSlots();
+      }
+
+      // Move to the first occupied slot from the current one, end is bucket
+      // table size and slot 0.
+      void SkipFreeSlots() {
+        const size_t size = map_->table_.GetTableSize();
+        while (index_ < size) {
+          uint32_t occupied = map_->table_.GetBucket(index_).GetOccupiedMask() & ~((1u << slot_) - 1);
+          if (occupied != 0) {
+            slot_ = __builtin_ctz(occupied);
+            return;
+          }
+          index_++;
+          slot_ = 0;
+        }
+      }
+
+      CuckoohashingTable* map_;
+      size_t index_;
+      size_t slot_;
+    };
+
+    LockedTable(const LockedTable&) = delete;
+    LockedTable& operator=(const LockedTable&) = delete;
+
+    LockedTable(LockedTable&& lockedTable)
+    : map_(lockedTable.map_), lockTable_(lockedTable.lockTable_),
+      resizeGuard_(std::move(lockedTable.resizeGuard_)) {
+      lockedTable.map_ = nullptr;
+    }
+
+    ~LockedTable() {
+      Unlock();
+    }
+
+    // Release the locks early, iterators are invalid afterwards.
+    void Unlock() {
+      if (map_ == nullptr) {
+        return;
+      }
+
+      map_->UnlockAllStripes(lockTable_);
+      resizeGuard_.unlock();
+      map_ = nullptr;
+    }
+
+    bool IfLocked() const {
+      return map_ != nullptr;
+    }
+
+    iterator begin() {
+      return iterator(map_, 0, 0);
+    }
+
+    iterator end() {
+      return iterator(map_, map_->table_.GetTableSize(), 0);
+    }
+
+    // number of keys in the table.
+    size_t Size() const {
+      size_t size = 0;
+      for (size_t i = 0; i < map_->table_.GetTableSize(); i++) {
+        size += __builtin_popcount(map_->table_.GetBucket(i).GetOccupiedMask());
+      }
+      return size;
+    }
+
+    // Erase the cell at it, return the iterator to the next cell.
+    iterator Erase(iterator it) {
+      map_->EraseCell(it.index_, it.slot_);
+      map_->SubEntries(1);
+      return ++it;
+    }
+
+    // Erase all keys, the number of buckets is kept.
+    void Clear() {
+      for (size_t i = 0; i < map_->table_.GetTableSize(); i++) {
+        Bucket bucket = map_->table_.GetBucket(i);
+        uint32_t occupied = bucket.GetOccupiedMask();
+        while (occupied != 0) {
+          map_->EraseCell(i, PopLowestBit(occupied));
+          map_->SubEntries(1);
+        }
+      }
+    }
+
+   private:
+    friend class CuckoohashingTable;
+
+    // Same lock order as a resize: resizeLock_ first, then all stripes.
+    explicit LockedTable(CuckoohashingTable* map)
+    : map_(map), lockTable_(nullptr), resizeGuard_(map->resizeLock_) {
+      map_->MigrateAll();
+      map_->FinishMigration();
+      lockTable_ = map_->LockAllStripes();
+    }
+
+    CuckoohashingTable* map_;
+    LockTable* lockTable_;
+    std::unique_lock<std::mutex> resizeGuard_;
+  };
+
+  // Lock the whole table for iteration and bulk changes, see LockedTable.
+  LockedTable LockAll() {
+    return LockedTable(this);
+  }
+
+  /*
+   * Call fn(const KeyType&, ValueType&) on every key from threadNum threads,
+   * the caller being one of them. Buckets are visited a chunk at a time with
+   * only the stripes of the chunk locked, so other operations keep running on
+   * the rest of the table. The table does not grow during the scan, an insert
+   * that needs a resize waits for it to finish.
+   *
+   * The scan is not a snapshot. A key in the table during the whole scan is
+   * visited once, unless a concurrent insert moves it to its other bucket,
+   * then it may be missed or visited twice. Keys inserted or erased meanwhile
+   * may or may not be visited. fn is called concurrently, it must not throw
+   * or call back into the table.
+   */
+  template <typename Fn>
+  void ParallelForEach(Fn fn, size_t threadNum) {
+    std::lock_guard<std::mutex> resizeGuard(resizeLock_);
+    MigrateAll();
+    FinishMigration();
+
+    // Neither changes until resizeLock_ is released.
+    LockTable* lockTable = locks_.load(std::memory_order_acquire);
+    const size_t tableSize = table_.GetTableSize();
+    const size_t chunkSize = SCAN_CHUNK_SIZE < lockTable->GetSize() ? SCAN_CHUNK_SIZE : lockTable->GetSize();
+    std::atomic<size_t> nextChunk(0);
+    auto scan = [this, lockTable, tableSize, chunkSize, &nextChunk, &fn]() {
+      while (true) {
+        const size_t begin = nextChunk.fetch_add(chunkSize, std::memory_order_relaxed);
+        if (begin >= tableSize) {
+          return;
+        }
+        ForEachInChunk(lockTable, begin, begin + chunkSize, fn);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadNum; i++) {
+      threads.emplace_back(scan);
+    }
+    scan();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
  private:
   enum CuckooStatusCode {
     OK,
@@ -56,449 +541,1771 @@ class CuckoohashingTable {
     DUPLICATE,
     FULL,
     MAXSTEP,
-    RESIZE
+    RESIZE,
+    PATH_INVALID,
+    NOT_FOUND,
+    RETRY
   };
 
 
 
-  class Spinlock {
+  /*
+   * LockStripe is a bucket lock with a version counter, one per cache line.
+   * The version is odd while the lock is held and bumped again on unlock, so
+   * an optimistic reader that sees the same even version before and after
+   * reading buckets knows no writer touched them meanwhile.
+   *
+   * It is also a reader-writer lock: shared holders only count themselves in
+   * readers_ and check the version is even, writers serialize on lock_ and
+   * then wait for readers to leave. A reader backs off while the version is
+   * odd, so writers are not starved by a stream of readers.
+   *
+   * An elided lock keeps neither: every critical section would write the
+   * version and conflict with all others on the stripe, and waiting for
+   * readers would abort the transaction. Readers take it like writers, in a
+   * transaction of their own, and tables with it never read optimistically.
+   */
+  class LockStripe {
   private:
-    std::atomic_flag lock_;
+    typedef std::integral_constant<bool, IsElidedLock<LockType>::value> ElidedLock;
+
+    LockType lock_;
+    std::atomic<size_t> version_;
+    std::atomic<size_t> readers_;
+
   public:
-    Spinlock() {
-      lock_.clear();
-    }
+    LockStripe(): version_(0), readers_(0) {}
 
     inline void lock() {
-      while (lock_.test_and_set(std::memory_order_acquire));
+      Lock(ElidedLock());
+    }
+
+    // Never run as a transaction, for callers holding many stripes at once.
+    inline void LockNotElided() {
+      LockNotElided(ElidedLock());
+    }
+
+    inline void lock_shared() {
+      LockShared(ElidedLock());
+    }
+
+    inline void unlock_shared() {
+      UnlockShared(ElidedLock());
     }
 
     inline void unlock() {
-      lock_.clear(std::memory_order_release);
+      Unlock(ElidedLock());
+    }
+
+    inline size_t GetVersion() const {
+      return version_.load(std::memory_order_acquire);
+    }
+
+    inline bool IfVersionChanged(size_t version) const {
+      return version_.load(std::memory_order_relaxed) != version;
+    }
+
+  private:
+    inline void Lock(std::false_type) {
+      lock_.lock();
+      version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_release);
+      Backoff backoff;
+      while (readers_.load(std::memory_order_seq_cst) != 0) {
+        backoff.Pause();
+      }
+    }
+
+    inline void Lock(std::true_type) {
+      lock_.lock();
+    }
+
+    inline void LockNotElided(std::false_type) {
+      Lock(std::false_type());
+    }
+
+    inline void LockNotElided(std::true_type) {
+      lock_.LockNotElided();
+    }
+
+    inline void LockShared(std::false_type) {
+      Backoff backoff;
+      while (true) {
+        readers_.fetch_add(1, std::memory_order_seq_cst);
+        if ((version_.load(std::memory_order_seq_cst) & 1) == 0) {
+          return;
+        }
+
+        readers_.fetch_sub(1, std::memory_order_relaxed);
+        while (version_.load(std::memory_order_relaxed) & 1) {
+          backoff.Pause();
+        }
+      }
+    }
+
+    inline void LockShared(std::true_type) {
+      lock_.lock();
+    }
+
+    inline void UnlockShared(std::false_type) {
+      readers_.fetch_sub(1, std::memory_order_release);
+    }
+
+    inline void UnlockShared(std::true_type) {
+      lock_.unlock();
+    }
+
+    inline void Unlock(std::false_type) {
+      version_.store(version_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      lock_.unlock();
+    }
+
+    inline void Unlock(std::true_type) {
+      lock_.unlock();
+    }
+  } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  /*
+   * LockTable is the array of lock stripes, its size is a power of two.
+   * Bucket i is guarded by stripe i & (size - 1), and a lock table never has
+   * more stripes than the table has buckets, so old bucket i and new buckets
+   * i and i + old size share one stripe while a resize is migrating them.
+   */
+  class LockTable {
+   public:
+    // Stripes come from the allocator of the buckets, so they are placed
+    // like the buckets they guard.
+    LockTable(size_t sizeBase, const Allocator& allocator)
+    : sizeBase_(sizeBase), allocator_(allocator),
+      stripes_(StripeTraits::allocate(allocator_, GetSize())) {
+      for (size_t i = 0; i < GetSize(); i++) {
+        new (&stripes_[i]) LockStripe();
+      }
+    }
+
+    ~LockTable() {
+      for (size_t i = 0; i < GetSize(); i++) {
+        stripes_[i].~LockStripe();
+      }
+      StripeTraits::deallocate(allocator_, stripes_, GetSize());
+    }
+
+    LockTable(const LockTable&) = delete;
+    LockTable& operator=(const LockTable&) = delete;
+
+    inline size_t GetSizeBase() const {
+      return sizeBase_;
+    }
+
+    inline size_t GetSize() const {
+      return size_t(1) << sizeBase_;
+    }
+
+    inline size_t StripeIndex(size_t bucketIndex) const {
+      return bucketIndex & (GetSize() - 1);
+    }
+
+    inline LockStripe& GetStripe(size_t stripeIndex) {
+      return stripes_[stripeIndex];
+    }
+
+    inline size_t GetBytes() const {
+      return sizeof(LockStripe) * GetSize();
+    }
+
+   private:
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<LockStripe> StripeAllocator;
+    typedef std::allocator_traits<StripeAllocator> StripeTraits;
+
+    const size_t sizeBase_;
+    StripeAllocator allocator_;
+    LockStripe* stripes_;
+  };
+
+  // exceptions
+  class TableSizeException {};
+
+  // value pool of tables with inline values.
+  struct NoValuePool {};
+
+  static constexpr size_t NextPowerOfTwo(size_t size) {
+    return size <= 1 ? 1 : 2 * NextPowerOfTwo((size + 1) / 2);
+  }
+
+  static constexpr size_t RoundUp(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+  }
+
+  // Compact cells of a bucket are its keys followed by its values.
+  static constexpr size_t VALUES_OFFSET =
+      COMPACT_CELLS ? RoundUp(BUCKET_SIZE * sizeof(KeyType), alignof(StoredValue)) : 0;
+  static constexpr size_t CELLS_ALIGN = !COMPACT_CELLS ? alignof(Cell) :
+      alignof(KeyType) > alignof(StoredValue) ? alignof(KeyType) : alignof(StoredValue);
+  static constexpr size_t CELLS_SIZE = !COMPACT_CELLS ? BUCKET_SIZE * sizeof(Cell) :
+      RoundUp(VALUES_OFFSET + BUCKET_SIZE * sizeof(StoredValue), CELLS_ALIGN);
+
+  // Uninitialized cells of one bucket.
+  typedef typename std::aligned_storage<CELLS_SIZE, CELLS_ALIGN>::type CellStorage;
+
+  typedef std::atomic<uint16_t> OccupiedMask;
+  static_assert(sizeof(OccupiedMask) == sizeof(uint16_t) && std::is_standard_layout<OccupiedMask>::value,
+                "occupied mask is zeroed with the rest of the bucket metadata");
+
+  // bits of all slots of a bucket.
+  static constexpr uint32_t FULL_MASK = (uint32_t(1) << BUCKET_SIZE) - 1;
+
+  // Tags and occupied bits of a bucket. Its size is rounded up to a power of
+  // two, so the metadata of a bucket never straddles two cache lines.
+  static constexpr size_t META_ALIGN =
+      NextPowerOfTwo(BUCKET_SIZE * sizeof(TagType) + sizeof(OccupiedMask));
+
+  struct alignas(META_ALIGN) BucketMeta {
+    std::array<TagType, BUCKET_SIZE> hashesArray;
+    // bit i is set if slot i is occupied. Only written with the bucket lock
+    // held, unlocked readers get the state of all slots in one load.
+    OccupiedMask occupied;
+  };
+
+  /*
+   * Bucket is a handle to bucket metadata and cells, which live in separate
+   * arrays of a BucketArray. It is cheap to copy. Its cells are an array of
+   * pairs, or with COMPACT_CELLS an array of keys and an array of values.
+   */
+  class Bucket {
+  private:
+    BucketMeta* meta_;
+    CellStorage* cells_;
+  public:
+    Bucket(BucketMeta* meta, CellStorage* cells): meta_(meta), cells_(cells) {}
+
+    inline bool IfOccupied(size_t i) const {
+      return (GetOccupiedMask() >> i) & 1;
+    }
+
+    inline TagType GetPartitialKey(size_t i) const {
+      return meta_->hashesArray[i];
+    }
+
+    inline const TagType* GetPartialKeys() const {
+      return meta_->hashesArray.data();
+    }
+
+    inline uint32_t GetOccupiedMask() const {
+      return meta_->occupied.load(std::memory_order_relaxed);
+    }
+
+    // Only for cells stored as pairs.
+    inline Cell& GetCell(size_t i) const {
+      return static_cast<Cell*>(static_cast<void*>(cells_))[i];
+    }
+
+    inline KeyType& GetKey(size_t i) const {
+      return KeyAt(i, CompactCells());
+    }
+
+    // The value, or the pointer to it for out of line values.
+    inline StoredValue& GetStoredValue(size_t i) const {
+      return StoredValueAt(i, CompactCells());
+    }
+
+    inline ValueType& GetValue(size_t i) const {
+      return ValueOf(GetStoredValue(i), OutOfLineValues());
+    }
+
+    inline const BucketMeta* GetMeta() const {
+      return meta_;
+    }
+
+    inline const CellStorage* GetCells() const {
+      return cells_;
+    }
+
+    inline void SetPartialKey(size_t i, TagType paritialKey) {
+      meta_->hashesArray[i] = paritialKey;
+    }
+
+    // The lock holder is the only writer, a plain store is enough.
+    inline void SetOccupiedBit(size_t i) {
+      meta_->occupied.store(static_cast<uint16_t>(GetOccupiedMask() | (1u << i)),
+                            std::memory_order_relaxed);
+    }
+
+    inline void ClearOccupiedBit(size_t i) {
+      meta_->occupied.store(static_cast<uint16_t>(GetOccupiedMask() & ~(1u << i)),
+                            std::memory_order_relaxed);
+    }
+
+    inline void SetKeyValue(size_t i, KeyType&& key, StoredValue&& value) {
+      SetKeyValue(i, std::move(key), std::move(value), CompactCells());
     }
 
-    inline bool try_lock() {
-      return !lock_.test_and_set(std::memory_order_acquire);
+    // Destroy the cell, an out of line value is left to the caller.
+    inline void EraseKeyValue(size_t i) {
+      EraseKeyValue(i, CompactCells());
     }
 
-  } __attribute__((aligned(64)));
+    inline bool IfAvailable() const {
+      return (~GetOccupiedMask() & FULL_MASK) != 0;
+    }
+
+    // return the first free slot, or -1 if the bucket is full.
+    inline int GetAvailableSlot() const {
+      const uint32_t freeMask = ~GetOccupiedMask() & FULL_MASK;
+      return freeMask == 0 ? -1 : __builtin_ctz(freeMask);
+    }
+
+  private:
+    inline KeyType* Keys() const {
+      return static_cast<KeyType*>(static_cast<void*>(cells_));
+    }
+
+    inline StoredValue* Values() const {
+      return static_cast<StoredValue*>(
+      static_cast<void*>(static_cast<char*>(static_cast<void*>(cells_)) + VALUES_OFFSET));
+    }
+
+    inline KeyType& KeyAt(size_t i, std::false_type) const {
+      return GetCell(i).first;
+    }
+
+    inline KeyType& KeyAt(size_t i, std::true_type) const {
+      return Keys()[i];
+    }
+
+    inline StoredValue& StoredValueAt(size_t i, std::false_type) const {
+      return GetCell(i).second;
+    }
+
+    inline StoredValue& StoredValueAt(size_t i, std::true_type) const {
+      return Values()[i];
+    }
+
+    inline void SetKeyValue(size_t i, KeyType&& key, StoredValue&& value, std::false_type) {
+      new (&GetCell(i)) Cell(std::move(key), std::move(value));
+    }
+
+    inline void SetKeyValue(size_t i, KeyType&& key, StoredValue&& value, std::true_type) {
+      new (&Keys()[i]) KeyType(std::move(key));
+      new (&Values()[i]) StoredValue(std::move(value));
+    }
+
+    inline void EraseKeyValue(size_t i, std::false_type) {
+      GetCell(i).~Cell();
+    }
+
+    // Compact keys and values are trivially destructible.
+    inline void EraseKeyValue(size_t, std::true_type) {}
+  };
+
+  /*
+   * BucketArray stores buckets as a struct of arrays: metadata of all buckets
+   * in one dense array and cells in another one. A lookup scans the metadata
+   * line of each of its buckets and touches cells only on a tag hit.
+   */
+  class BucketArray {
+   public:
+    BucketArray(size_t size, const Allocator& allocator)
+    : size_(size), metaAllocator_(allocator), cellAllocator_(allocator),
+      metas_(MetaTraits::allocate(metaAllocator_, size)), cells_(nullptr) {
+      try {
+        cells_ = CellTraits::allocate(cellAllocator_, size);
+      } catch (...) {
+        MetaTraits::deallocate(metaAllocator_, metas_, size);
+        throw;
+      }
+      std::memset(static_cast<void*>(metas_), 0, sizeof(BucketMeta) * size);
+    }
+
+    ~BucketArray() {
+      for (size_t index = 0; index < size_; index++) {
+        Bucket bucket = GetBucket(index);
+        uint32_t occupied = bucket.GetOccupiedMask();
+        while (occupied != 0) {
+          const size_t slot = PopLowestBit(occupied);
+          // memory of out of line values goes away with the value pool.
+          DestroyValue(bucket.GetStoredValue(slot), OutOfLineValues());
+          bucket.EraseKeyValue(slot);
+        }
+      }
+      MetaTraits::deallocate(metaAllocator_, metas_, size_);
+      CellTraits::deallocate(cellAllocator_, cells_, size_);
+    }
+
+    BucketArray(const BucketArray&) = delete;
+    BucketArray& operator=(const BucketArray&) = delete;
+
+    inline size_t GetSize() const {
+      return size_;
+    }
+
+    inline Bucket GetBucket(size_t index) const {
+      return Bucket(&metas_[index], &cells_[index]);
+    }
+
+    inline size_t GetBytes() const {
+      return (sizeof(BucketMeta) + sizeof(CellStorage)) * size_;
+    }
+
+   private:
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<BucketMeta> MetaAllocator;
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<CellStorage> CellAllocator;
+    typedef std::allocator_traits<MetaAllocator> MetaTraits;
+    typedef std::allocator_traits<CellAllocator> CellTraits;
+
+    const size_t size_;
+    MetaAllocator metaAllocator_;
+    CellAllocator cellAllocator_;
+    BucketMeta* metas_;
+    CellStorage* cells_;
+  };
+
+  /*
+   * BucketMetadata class saves the index of buckets in table, and the locks acquired if any.
+   * BucketMetadata is responsible to release locks.
+   */
+  template <size_t N>
+  class BucketMetadata {
+  private:
+    static_assert(N >= 1 && N <= 3, "BucketMetadata should only be used"
+    " for between 1 and 3 locks");
+
+    std::array<size_t, N> indexes;
+    size_t tableSize;
+    CuckoohashingTable *map_;
+  public:
+    BucketMetadata(): tableSize(0), map_(nullptr) {}
+
+    template <typename... Args>
+    BucketMetadata(CuckoohashingTable* map, size_t tableSizeBase, Args&&... inds)
+    : indexes{{inds...}}, tableSize(tableSizeBase), map_(map) {}
+
+    // A BucketMetadata owns the locks it holds, so it can only be moved.
+    // Copying it would release the same locks twice.
+    BucketMetadata(const BucketMetadata& bucketMetadata) = delete;
+    BucketMetadata& operator=(const BucketMetadata& bucketMetadata) = delete;
+
+    BucketMetadata(BucketMetadata&& bucketMetadata)
+    : indexes(bucketMetadata.indexes),
+      tableSize(bucketMetadata.tableSize),
+      map_(bucketMetadata.map_) {
+      bucketMetadata.map_ = nullptr;
+    }
+
+    BucketMetadata& operator=(BucketMetadata&& bucketMetadata) {
+      if (this != &bucketMetadata) {
+        Release();
+        indexes = bucketMetadata.indexes;
+        tableSize = bucketMetadata.tableSize;
+        map_ = bucketMetadata.map_;
+        bucketMetadata.map_ = nullptr;
+      }
+      return *this;
+    }
+
+    ~BucketMetadata() {
+      Release();
+    }
+
+    inline void Release() {
+      // Has been called Release() somewhere
+      if (map_ == nullptr) {
+        return;
+      }
+
+      Unlock();
+      map_ = nullptr;
+    }
+
+    inline void AddBucket(size_t i, size_t bucketPos) {
+      if (i >= N) {
+        // log error
+      } else {
+        indexes[i] = bucketPos;
+      }
+    }
+
+    inline void AddTableSize(size_t i) {
+      tableSize = i;
+    }
+
+    inline CuckoohashingTable* GetMapPtr() const {
+      return map_;
+    }
+
+    inline size_t GetTableSizeBase() const {
+      return tableSize;
+    }
+
+    inline bool Lock() {
+      if (N == 2) {
+        return map_->LockTwo(tableSize, indexes[0], indexes[1]);
+      }
+
+      return false;
+    }
+
+    inline void Unlock() {
+      for (size_t i = 0; i < N; i++) {
+        // two buckets may share one lock, release it only once.
+        bool released = false;
+        for (size_t j = 0; j < i; j++) {
+          released = released || map_->LockIndex(indexes[j]) == map_->LockIndex(indexes[i]);
+        }
+        if (!released) {
+          map_->Unlock(indexes[i]);
+        }
+      }
+    }
+
+    size_t inline GetN(size_t i) const {
+        return indexes[i];
+    }
+  };
+
+  typedef BucketMetadata<2> TwoBucketMetadata;
+
+  // SharedTwoBucketLock releases the two buckets a lookup locked in shared mode.
+  class SharedTwoBucketLock {
+   private:
+    CuckoohashingTable* map_;
+    size_t posFirst_;
+    size_t posSecond_;
+
+   public:
+    SharedTwoBucketLock(CuckoohashingTable* map, size_t posFirst, size_t posSecond)
+    : map_(map), posFirst_(posFirst), posSecond_(posSecond) {}
+
+    SharedTwoBucketLock(const SharedTwoBucketLock&) = delete;
+    SharedTwoBucketLock& operator=(const SharedTwoBucketLock&) = delete;
+
+    ~SharedTwoBucketLock() {
+      map_->UnlockTwoShared(posFirst_, posSecond_);
+    }
+  };
+
+  /*
+   * Table owns the bucket array. On resize the new array is published right
+   * away and the old one is kept until every old bucket has been migrated,
+   * so operations never wait for a whole table copy.
+   * Old bucket i is split into new buckets i and i + old size, and a key's two
+   * buckets map to the same stripes before and after a resize that keeps the
+   * lock table, so the lock of a bucket also protects its old bucket.
+   */
+  class Table {
+   public:
+    Table(size_t sizeBase, const Allocator& allocator)
+    : allocator_(allocator), sizeBase_(sizeBase), oldSizeBase_(0), oldBuckets_(nullptr),
+      migrated_(nullptr), migrateCursor_(0), unmigrated_(0), migrating_(false) {
+      size_t size = size_t(1) << sizeBase;
+      buckets_ = new BucketArray(size, allocator_);
+    }
+
+    ~Table() {
+      DeallocMem();
+    }
+
+    inline size_t GetTableSize() const {
+      return size_t(1) << sizeBase_.load(std::memory_order_acquire);
+    }
+
+    inline size_t GetTableSizeBase() {
+      return sizeBase_.load(std::memory_order_acquire);
+    }
+
+    inline const Allocator& GetAllocator() const {
+      return allocator_;
+    }
+
+    // Must be called with resizeLock_ held, old buckets are freed under it.
+    size_t GetBytes() const {
+      size_t bytes = buckets_.load(std::memory_order_acquire)->GetBytes();
+      const BucketArray* oldBuckets = oldBuckets_.load(std::memory_order_acquire);
+      if (oldBuckets != nullptr) {
+        bytes += oldBuckets->GetBytes() + sizeof(std::atomic<bool>) * oldBuckets->GetSize();
+      }
+      return bytes;
+    }
+
+    Bucket GetBucket(size_t index) {
+      return buckets_.load(std::memory_order_acquire)->GetBucket(index);
+    }
+
+    // Can be called without locks, as a hint whether some old buckets are
+    // not migrated yet. It turns false as soon as the last one is migrated,
+    // the old buckets may be freed later.
+    inline bool IfMigrating() const {
+      return migrating_.load(std::memory_order_acquire);
+    }
+
+    // Can be called without locks, as a hint whether old buckets are kept.
+    inline bool HasOldBuckets() const {
+      return oldBuckets_.load(std::memory_order_relaxed) != nullptr;
+    }
+
+    inline bool IfAllMigrated() const {
+      return unmigrated_.load(std::memory_order_acquire) == 0;
+    }
+
+    // Reserve count old buckets to migrate, return the first one.
+    inline size_t ClaimOldBuckets(size_t count) {
+      return migrateCursor_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // Following functions about old buckets must be called with the lock of
+    // the bucket held, or by an optimistic reader which validates what it read
+    // with the lock versions.
+
+    inline size_t GetOldTableSizeBase() const {
+      return oldSizeBase_.load(std::memory_order_relaxed);
+    }
+
+    Bucket GetOldBucket(size_t index) {
+      return oldBuckets_.load(std::memory_order_relaxed)->GetBucket(index);
+    }
+
+    inline bool IfMigrated(size_t index) const {
+      return migrated_.load(std::memory_order_relaxed)[index].load(std::memory_order_relaxed);
+    }
+
+    // return true if index was the last old bucket to migrate.
+    inline bool SetMigrated(size_t index) {
+      migrated_.load(std::memory_order_relaxed)[index].store(true, std::memory_order_relaxed);
+      if (unmigrated_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return false;
+      }
+      migrating_.store(false, std::memory_order_release);
+      return true;
+    }
+
+    // Set oldBucket to the old bucket holding the cells of new bucket index
+    // and return true until it is migrated. Safe for optimistic readers: old
+    // size base is loaded first and old arrays only get larger, so it never
+    // indexes past the arrays it loads, even when they come from a later resize.
+    bool GetUnmigratedOldBucket(size_t index, Bucket& oldBucket) {
+      const size_t oldSizeBase = oldSizeBase_.load(std::memory_order_acquire);
+      BucketArray* oldBuckets = oldBuckets_.load(std::memory_order_relaxed);
+      std::atomic<bool>* migrated = migrated_.load(std::memory_order_relaxed);
+      if (oldBuckets == nullptr || migrated == nullptr) {
+        return false;
+      }
+
+      const size_t oldIndex = index & ((size_t(1) << oldSizeBase) - 1);
+      if (migrated[oldIndex].load(std::memory_order_relaxed)) {
+        return false;
+      }
+      oldBucket = oldBuckets->GetBucket(oldIndex);
+      return true;
+    }
+
+    // Publish a bucket array twice as large, must be called with all locks held.
+    // Bucket array is stored before size base, so a reader that sees the new size
+    // base never indexes the old, smaller array with it.
+    void Grow(std::unique_ptr<BucketArray> newBuckets, std::unique_ptr<std::atomic<bool>[]> migrated) {
+      const size_t oldSizeBase = sizeBase_.load(std::memory_order_relaxed);
+      oldBuckets_.store(buckets_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+      migrated_.store(migrated.release(), std::memory_order_relaxed);
+      oldSizeBase_.store(oldSizeBase, std::memory_order_release);
+      migrateCursor_.store(0, std::memory_order_relaxed);
+      unmigrated_.store(size_t(1) << oldSizeBase, std::memory_order_relaxed);
+      migrating_.store(true, std::memory_order_relaxed);
+      buckets_.store(newBuckets.release(), std::memory_order_release);
+      sizeBase_.store(oldSizeBase + 1, std::memory_order_release);
+    }
+
+    // Stop using old buckets once all of them are migrated, must be called with
+    // all locks held. Caller frees the returned buckets and flags once no
+    // unlocked reader can see them.
+    BucketArray* DetachOldBuckets(std::atomic<bool>*& migrated) {
+      BucketArray* oldBuckets = oldBuckets_.load(std::memory_order_relaxed);
+      oldBuckets_.store(nullptr, std::memory_order_relaxed);
+      migrated = migrated_.load(std::memory_order_relaxed);
+      migrated_.store(nullptr, std::memory_order_relaxed);
+      return oldBuckets;
+    }
+
+   private:
+    void DeallocMem() {
+      delete buckets_.load();
+      delete oldBuckets_.load();
+      delete[] migrated_.load();
+    }
+
+    const Allocator allocator_;
+
+    std::atomic<size_t> sizeBase_;
+    std::atomic<BucketArray*> buckets_;
+
+    std::atomic<size_t> oldSizeBase_;
+    std::atomic<BucketArray*> oldBuckets_;
+    std::atomic<std::atomic<bool>*> migrated_;
+    std::atomic<size_t> migrateCursor_;
+    std::atomic<size_t> unmigrated_;
+    std::atomic<bool> migrating_;
+  };
+
+  /*
+   * UnlockedReadGuard marks a thread reading buckets without their locks, such
+   * as SearchCuckooPath. Old buckets are only freed after all such readers that
+   * may have seen them are gone.
+   */
+  class UnlockedReadGuard {
+   private:
+    std::atomic<size_t>& readers_;
+
+   public:
+    UnlockedReadGuard(CuckoohashingTable* map)
+    : readers_(map->LocalReaderSlot().readers) {
+      readers_.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    ~UnlockedReadGuard() {
+      readers_.fetch_sub(1, std::memory_order_release);
+    }
+  };
+
+  /*
+   * ReaderSlot also counts keys inserted minus keys erased by the threads of
+   * the slot. A key erased by another thread than the one inserting it makes
+   * a slot wrap below zero, only the sum over all slots is a count of keys.
+   */
+  struct alignas(CACHE_LINE_SIZE) ReaderSlot {
+    std::atomic<size_t> readers;
+    std::atomic<size_t> entries;
+
+    ReaderSlot(): readers(0), entries(0) {}
+  };
+
+  typedef typename std::allocator_traits<Allocator>::template rebind_alloc<ReaderSlot> ReaderSlotAllocator;
+
+  /*
+   * ThreadIds numbers live threads densely: the id of an exiting thread goes
+   * to the next thread that asks for one, so threads coming and going, such
+   * as the workers of every ParallelForEach, do not use up ids. Live threads
+   * only share a reader slot when there are more of them than slots.
+   */
+  class ThreadIds {
+   public:
+    static inline size_t Local() {
+      static thread_local Holder holder;
+      return holder.id;
+    }
+
+   private:
+    struct Shared {
+      std::mutex lock;
+      std::vector<size_t> freeIds;
+      size_t nextId;
+
+      Shared(): nextId(0) {}
+    };
+
+    struct Holder {
+      size_t id;
+
+      Holder() {
+        Shared& shared = GetShared();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        if (shared.freeIds.empty()) {
+          id = shared.nextId++;
+        } else {
+          id = shared.freeIds.back();
+          shared.freeIds.pop_back();
+        }
+      }
+
+      ~Holder() {
+        Shared& shared = GetShared();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        shared.freeIds.push_back(id);
+      }
+    };
+
+    // never destroyed, threads exiting after main still use it.
+    static Shared& GetShared() {
+      static Shared* shared = new Shared();
+      return *shared;
+    }
+  };
+
+  // a power of two, so a slot is picked with a mask.
+  static size_t ReaderSlotNum() {
+    const size_t threads = std::thread::hardware_concurrency();
+    const size_t slots = (threads == 0 ? 1 : threads) * READER_SLOTS_PER_THREAD;
+    size_t slotNum = 1;
+    while (slotNum < slots) {
+      slotNum <<= 1;
+    }
+    return slotNum;
+  }
+
+  inline ReaderSlot& LocalReaderSlot() {
+    return readerSlots_[ThreadIds::Local() & (readerSlots_.size() - 1)];
+  }
+
+  // Called after the bucket locks are released, so an elided critical section
+  // does not write a counter other threads write too.
+  inline void AddEntries(size_t count) {
+    LocalReaderSlot().entries.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  inline void SubEntries(size_t count) {
+    LocalReaderSlot().entries.fetch_sub(count, std::memory_order_relaxed);
+  }
+
+  void WaitForUnlockedReaders() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (auto& slot : readerSlots_) {
+      while (slot.readers.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  /*
+   * CuckooPathNode is one hop of a cuckoo path: the cell in `slot` of bucket
+   * `from` is displaced to `to`, the other candidate bucket of its key.
+   */
+  struct CuckooPathNode {
+    size_t from;
+    size_t to;
+    size_t slot;
+  };
+
+  struct alignas(CACHE_LINE_SIZE) CuckooPath {
+    std::array<CuckooPathNode, MAX_STEP_LIMIT> nodes;
+    size_t length;
+  };
+
+  /*
+   * BfsNode is a bucket reached by the breadth first search, parent is its
+   * position in the frontier and slot is the cell of the parent bucket that
+   * would be moved to reach it.
+   */
+  struct BfsNode {
+    size_t bucket;
+    uint16_t parent;
+    uint8_t slot;
+    uint8_t depth;
+  };
+
+  struct alignas(CACHE_LINE_SIZE) BfsQueue {
+    std::array<BfsNode, MAX_BFS_QUEUE_SIZE> nodes;
+    size_t head;
+    size_t tail;
+
+    inline void Reset() {
+      head = 0;
+      tail = 0;
+    }
+
+    inline bool Empty() const {
+      return head == tail;
+    }
+
+    inline bool Full() const {
+      return tail == MAX_BFS_QUEUE_SIZE;
+    }
+
+    inline void Push(size_t bucket, uint16_t parent, uint8_t slot, uint8_t depth) {
+      nodes[tail++] = BfsNode{bucket, parent, slot, depth};
+    }
+  };
+
+  // Search buffers are reused by every insert of a thread instead of being
+  // allocated per insert.
+  static inline CuckooPath& LocalCuckooPath() {
+    static thread_local CuckooPath cuckooPath;
+    return cuckooPath;
+  }
+
+  static inline BfsQueue& LocalBfsQueue() {
+    static thread_local BfsQueue bfsQueue;
+    return bfsQueue;
+  }
+
+  static constexpr size_t SizeBaseOf(size_t size) {
+    return size <= 1 ? 0 : 1 + SizeBaseOf(size >> 1);
+  }
+
+  // Smallest power of two bucket count holding initialCapacity keys, at least
+  // two buckets so that the two buckets of a key differ.
+  static size_t InitialSizeBase(size_t initialCapacity) {
+    size_t sizeBase = 1;
+    while ((size_t(1) << sizeBase) * BUCKET_SIZE < initialCapacity) {
+      sizeBase++;
+    }
+    return sizeBase;
+  }
+
+  static size_t MaxLockSizeBase() {
+    size_t threads = std::thread::hardware_concurrency();
+    size_t sizeBase = SizeBaseOf(threads * STRIPES_PER_THREAD);
+    if ((size_t(1) << sizeBase) < threads * STRIPES_PER_THREAD) {
+      sizeBase++;
+    }
+    return sizeBase < SizeBaseOf(STRIPES_PER_THREAD) ? SizeBaseOf(STRIPES_PER_THREAD) : sizeBase;
+  }
+
+  // Bucket index comes from the low bits of the hash and the partial key from
+  // the top byte, so the user hash is mixed first: std::hash of integers is
+  // the identity, which leaves the top byte zero and clusters strided keys.
+  inline size_t GetHashValue(const KeyType& key) const {
+    return MixHash(keyHasher(key));
+  }
+
+  // finalizer of 64-bit MurmurHash3, every input bit affects every output bit.
+  static inline size_t MixHash(size_t hashValue) {
+    uint64_t h = static_cast<uint64_t>(hashValue);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return static_cast<size_t>(h);
+  }
+
+  // Occupied slots of bucket whose tag equals paritialKey, as a bitmask.
+  inline uint32_t MatchPartialKey(const Bucket& bucket, TagType paritialKey) const {
+    return TagMatch<BUCKET_SIZE, TagType>::Match(bucket.GetPartialKeys(), paritialKey) &
+           bucket.GetOccupiedMask();
+  }
+
+  // Same as above for both buckets of a key, bits of second start at BUCKET_SIZE.
+  inline uint32_t MatchPartialKey(const Bucket& first, const Bucket& second, TagType paritialKey) const {
+    return TagMatch<BUCKET_SIZE, TagType>::MatchPair(first.GetPartialKeys(), second.GetPartialKeys(), paritialKey) &
+           (first.GetOccupiedMask() | (second.GetOccupiedMask() << BUCKET_SIZE));
+  }
+
+  static inline size_t PopLowestBit(uint32_t& mask) {
+    size_t bit = __builtin_ctz(mask);
+    mask &= mask - 1;
+    return bit;
+  }
+
+  // Keys and values that can be copied bytewise are read without locks,
+  // others could be destroyed by a writer while being read. Out of line
+  // values could be freed and reused from the pool. Elided locks keep no
+  // versions to validate such reads.
+  typedef std::integral_constant<bool,
+      std::is_trivially_copyable<KeyType>::value &&
+      std::is_trivially_copyable<ValueType>::value && !OUT_OF_LINE_VALUES &&
+      !IsElidedLock<LockType>::value> OptimisticReadable;
+
+  // fn gets a copy of the value when it is read optimistically.
+  template <typename Fn>
+  bool CuckooLookupLoop(size_t hashValue, const KeyType& key, Fn fn) {
+      MigrateStep();
+
+      if (OptimisticReadable::value) {
+        for (size_t i = 0; i < OPTIMISTIC_READ_RETRY; i++) {
+          CuckooStatusCode code = OptimisticLookup(hashValue, key, fn, OptimisticReadable());
+          if (code != CuckooStatusCode::RETRY) {
+            return code == CuckooStatusCode::OK;
+          }
+        }
+      }
+
+      // Too many writers on these buckets, wait for them on the locks.
+      return CuckooLockedLookup(hashValue, key, fn);
+  }
+
+  // fn(i, value) is called for every key found.
+  template <typename Fn>
+  size_t CuckooLookupBatch(const KeyType* keys, size_t count, bool* found, Fn fn) {
+    size_t hashValues[PREFETCH_GROUP_SIZE];
+    size_t foundNum = 0;
+    for (size_t begin = 0; begin < count; begin += PREFETCH_GROUP_SIZE) {
+      const size_t end = begin + PREFETCH_GROUP_SIZE < count ? begin + PREFETCH_GROUP_SIZE : count;
+      PrefetchGroup(keys, begin, end, hashValues, false);
+      for (size_t i = begin; i < end; i++) {
+        found[i] = CuckooLookupLoop(hashValues[i - begin], keys[i], [&fn, i](const ValueType& value) {
+          fn(i, value);
+        });
+        foundNum += found[i];
+      }
+    }
+    return foundNum;
+  }
+
+  // Hash keys [begin, end) into hashValues and prefetch their buckets and lock
+  // stripes. Nothing is locked, a resize meanwhile only makes the prefetch useless,
+  // but the bucket array is read to find the buckets, so it must not be freed.
+  void PrefetchGroup(const KeyType* keys, size_t begin, size_t end, size_t* hashValues, bool forWrite) {
+    for (size_t i = begin; i < end; i++) {
+      hashValues[i - begin] = GetHashValue(keys[i]);
+    }
+
+    UnlockedReadGuard readGuard(this);
+    LockTable* lockTable = locks_.load(std::memory_order_acquire);
+    const size_t tableSizeBase = table_.GetTableSizeBase();
+    for (size_t i = begin; i < end; i++) {
+      auto stripes = TwoBucketsPos(lockTable->GetSizeBase(), hashValues[i - begin]);
+      auto indexes = TwoBucketsPos(tableSizeBase, hashValues[i - begin]);
+      // lock stripes are written by writers and by readers taking them shared.
+      __builtin_prefetch(&lockTable->GetStripe(stripes.first), 1);
+      __builtin_prefetch(&lockTable->GetStripe(stripes.second), 1);
+      PrefetchBucket(table_.GetBucket(indexes.first), forWrite);
+      PrefetchBucket(table_.GetBucket(indexes.second), forWrite);
+    }
+    if (forWrite) {
+      return;
+    }
+
+    // Metadata of the group is on its way, cells are only fetched for slots
+    // whose tag matches, so keys not in the table never touch cells.
+    for (size_t i = begin; i < end; i++) {
+      auto indexes = TwoBucketsPos(tableSizeBase, hashValues[i - begin]);
+      const Bucket buckets[2] = {table_.GetBucket(indexes.first), table_.GetBucket(indexes.second)};
+      uint32_t hits = MatchPartialKey(buckets[0], buckets[1], PartialHashValue(hashValues[i - begin]));
+      while (hits != 0) {
+        const size_t bit = PopLowestBit(hits);
+        __builtin_prefetch(&buckets[bit / BUCKET_SIZE].GetKey(bit % BUCKET_SIZE), 0);
+      }
+    }
+  }
+
+  // An insert writes the metadata line, and the first cell line usually holds
+  // its free slot, large buckets are not prefetched whole. A lookup only needs
+  // the metadata line to filter a key.
+  static inline void PrefetchBucket(const Bucket& bucket, bool forWrite) {
+    if (forWrite) {
+      __builtin_prefetch(bucket.GetMeta(), 1);
+      __builtin_prefetch(bucket.GetCells(), 1);
+    } else {
+      __builtin_prefetch(bucket.GetMeta(), 0);
+    }
+  }
+
+  // Readers share the bucket locks, so lookups of the same hot key do not
+  // serialize. Old buckets are read in place, migration needs exclusive locks.
+  template <typename Fn>
+  bool CuckooLockedLookup(size_t hashValue, const KeyType& key, Fn& fn) {
+    while (true) {
+      const size_t tableSizeBase = table_.GetTableSizeBase();
+      auto indexes = TwoBucketsPos(tableSizeBase, hashValue);
+      if (!LockTwoShared(tableSizeBase, indexes.first, indexes.second)) {
+        continue;
+      }
+
+      SharedTwoBucketLock sharedLock(this, indexes.first, indexes.second);
+      return CuckooLookup(key, PartialHashValue(hashValue), indexes.first, indexes.second, fn);
+    }
+  }
+
+  /*
+   * Seqlock style lookup without taking locks: read the versions of the two
+   * bucket locks, copy out the key and value, then check the versions again.
+   * Versions are read before the table size, so a resize in between is seen as
+   * a version change too. Return RETRY if any writer got in the way.
+   */
+  template <typename Fn>
+  CuckooStatusCode OptimisticLookup(size_t hashValue, const KeyType& key, Fn& fn, std::true_type) {
+    UnlockedReadGuard readGuard(this);
+
+    // Stripes of a key's two buckets are its two buckets in a table as large
+    // as the lock table.
+    LockTable* lockTable = locks_.load(std::memory_order_acquire);
+    auto stripes = TwoBucketsPos(lockTable->GetSizeBase(), hashValue);
+    const LockStripe& lockFirst = lockTable->GetStripe(stripes.first);
+    const LockStripe& lockSecond = lockTable->GetStripe(stripes.second);
+    const size_t versionFirst = lockFirst.GetVersion();
+    const size_t versionSecond = lockSecond.GetVersion();
+    // A replaced lock table is not used by writers anymore.
+    if (((versionFirst | versionSecond) & 1) || lockTable != locks_.load(std::memory_order_acquire)) {
+      return CuckooStatusCode::RETRY;
+    }
+
+    auto indexes = TwoBucketsPos(table_.GetTableSizeBase(), hashValue);
+    typename std::aligned_storage<sizeof(KeyType), alignof(KeyType)>::type keyCopy;
+    typename std::aligned_storage<sizeof(ValueType), alignof(ValueType)>::type valueCopy;
+    bool found = false;
+    Bucket buckets[2] = {GetBucketForRead(indexes.first), GetBucketForRead(indexes.second)};
+    uint32_t hits = MatchPartialKey(buckets[0], buckets[1], PartialHashValue(hashValue));
+    while (hits != 0 && !found) {
+      size_t bit = PopLowestBit(hits);
+
+      // compare a private copy, the cell may be overwritten meanwhile.
+      const Bucket& bucket = buckets[bit / BUCKET_SIZE];
+      const size_t slot = bit % BUCKET_SIZE;
+      std::memcpy(&keyCopy, &bucket.GetKey(slot), sizeof(KeyType));
+      if (keyEqualChekcer(*reinterpret_cast<const KeyType*>(&keyCopy), key)) {
+        std::memcpy(&valueCopy, &bucket.GetValue(slot), sizeof(ValueType));
+        found = true;
+      }
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (lockFirst.IfVersionChanged(versionFirst) || lockSecond.IfVersionChanged(versionSecond)) {
+      return CuckooStatusCode::RETRY;
+    }
+
+    if (!found) {
+      return CuckooStatusCode::NOT_FOUND;
+    }
+
+    fn(*reinterpret_cast<const ValueType*>(&valueCopy));
+    return CuckooStatusCode::OK;
+  }
+
+  template <typename Fn>
+  CuckooStatusCode OptimisticLookup(size_t, const KeyType&, Fn&, std::false_type) {
+    return CuckooStatusCode::RETRY;
+  }
+
+  // Call fn on the value if key is in one of its buckets.
+  // Tags of both buckets are matched at once, only cells with the same tag are compared.
+  template <typename Fn>
+  bool CuckooLookup(const KeyType& key,
+                    TagType paritialKey,
+                    size_t posFirst,
+                    size_t posSecond,
+                    Fn& fn) {
+    Bucket buckets[2] = {GetBucketForRead(posFirst), GetBucketForRead(posSecond)};
+    uint32_t hits = MatchPartialKey(buckets[0], buckets[1], paritialKey);
+    while (hits != 0) {
+      size_t bit = PopLowestBit(hits);
+      const Bucket& bucket = buckets[bit / BUCKET_SIZE];
+      const size_t slot = bit % BUCKET_SIZE;
+      if (keyEqualChekcer(bucket.GetKey(slot), key)) {
+        fn(static_cast<const ValueType&>(bucket.GetValue(slot)));
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  // return the slot of key in bucket, or -1 if key is not there.
+  int FindSlot(const KeyType& key, TagType paritialKey, const Bucket& bucket) {
+    uint32_t hits = MatchPartialKey(bucket, paritialKey);
+    while (hits != 0) {
+      size_t i = PopLowestBit(hits);
+      if (keyEqualChekcer(bucket.GetKey(i), key)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  /*
+   * Visit buckets [begin, end) with their stripes locked. A chunk is never
+   * larger than the lock table and starts at a multiple of its size, so its
+   * stripes are distinct and consecutive, and locking them in ascending order
+   * is the order LockTwo uses.
+   */
+  template <typename Fn>
+  void ForEachInChunk(LockTable* lockTable, size_t begin, size_t end, Fn& fn) {
+    const size_t firstStripe = lockTable->StripeIndex(begin);
+    for (size_t i = 0; i < end - begin; i++) {
+      lockTable->GetStripe(firstStripe + i).LockNotElided();
+    }
+
+    for (size_t index = begin; index < end; index++) {
+      Bucket bucket = table_.GetBucket(index);
+      uint32_t occupied = bucket.GetOccupiedMask();
+      while (occupied != 0) {
+        const size_t slot = PopLowestBit(occupied);
+        fn(static_cast<const KeyType&>(bucket.GetKey(slot)), bucket.GetValue(slot));
+      }
+    }
+
+    for (size_t i = 0; i < end - begin; i++) {
+      lockTable->GetStripe(firstStripe + i).unlock();
+    }
+  }
+
+  // Destroy the cell of bucket index and clear its occupied bit, the slot is
+  // free right away. Must be called with the lock of the bucket held.
+  inline void EraseCell(size_t index, size_t slot) {
+    Bucket bucket = table_.GetBucket(index);
+    StoredValue& value = bucket.GetStoredValue(slot);
+    DestroyValue(value, OutOfLineValues());
+    FreeValue(value, OutOfLineValues());
+    bucket.EraseKeyValue(slot);
+    bucket.ClearOccupiedBit(slot);
+  }
+
+  // The value a cell holds, or points to.
+  static inline ValueType& ValueOf(ValueType& value, std::false_type) {
+    return value;
+  }
+
+  static inline ValueType& ValueOf(ValueType* value, std::true_type) {
+    return *value;
+  }
+
+  // What to store in a new cell for value.
+  inline ValueType&& NewValue(ValueType&& value, std::false_type) {
+    return std::move(value);
+  }
+
+  inline ValueType* NewValue(ValueType&& value, std::true_type) {
+    void* memory = valuePool_.Allocate();
+    try {
+      return new (memory) ValueType(std::move(value));
+    } catch (...) {
+      valuePool_.Free(memory);
+      throw;
+    }
+  }
+
+  // An inline value is destroyed with its cell.
+  static inline void DestroyValue(ValueType&, std::false_type) {}
+
+  static inline void DestroyValue(ValueType* value, std::true_type) {
+    value->~ValueType();
+  }
+
+  inline void FreeValue(ValueType&, std::false_type) {}
+
+  inline void FreeValue(ValueType* value, std::true_type) {
+    valuePool_.Free(value);
+  }
+
+  inline size_t ValuePoolBytes(std::false_type) {
+    return 0;
+  }
 
+  inline size_t ValuePoolBytes(std::true_type) {
+    return valuePool_.GetBytes();
+  }
 
-  class Mutexlock {
-  private:
-    std::mutex lock_;
+  template <typename Pred>
+  bool CuckooEraseLoop(const KeyType& key, Pred pred) {
+    MigrateStep();
+    const size_t hashValue = GetHashValue(key);
+    auto indexes = SnapshotAndLockTwo(hashValue);
+    for (size_t i = 0; i < 2; i++) {
+      MigrateIfNeeded(indexes.GetN(i));
+      Bucket bucket = table_.GetBucket(indexes.GetN(i));
+      int slot = FindSlot(key, PartialHashValue(hashValue), bucket);
+      if (slot == -1) {
+        continue;
+      }
 
-  public:
-    inline void lock() {
-      lock_.lock();
+      if (!pred(static_cast<const ValueType&>(bucket.GetValue(slot)))) {
+        return false;
+      }
+      EraseCell(indexes.GetN(i), slot);
+      indexes.Release();
+      SubEntries(1);
+      return true;
     }
 
-    inline void unlock() {
-      lock_.unlock();
-    }
+    return false;
+  }
 
-    inline bool try_lock() {
-      return lock_.try_lock();
-    }
-  }__attribute__((aligned(64)));
+  // The slot is published only after its key and value are constructed, so
+  // a throwing constructor or allocation leaves it free.
+  CuckooStatusCode InsertOneBucket(size_t i, size_t index, TagType paritialKey, KeyType&& key, ValueType&& value) {
+    Bucket bucket = table_.GetBucket(index);
 
-  // exceptions
-  class TableSizeException {};
+    StoreKeyValue(bucket, i, std::forward<KeyType>(key), std::forward<ValueType>(value), OutOfLineValues());
+    bucket.SetPartialKey(i, paritialKey);
+    bucket.SetOccupiedBit(i);
 
-  typedef std::pair<KeyType, ValueType> Cell;
-  class Bucket {
-  private:
-    // std::array is as efficient as array initialized as [], where
-    // std::array provides more functions to set and get data.
-    std::array<char, BUCKET_SIZE> hashesArray_;
-    std::array<typename std::aligned_storage<
-             sizeof(Cell), alignof(Cell)>::type,
-             BUCKET_SIZE> Cells_;
-    std::bitset<BUCKET_SIZE> occupied_;
-  public:
-    inline bool IfOccupied(size_t i)  {
-      return occupied_[i];
-    }
+    return CuckooStatusCode::INSERT;
+  }
 
-    inline char GetPartitialKey(size_t i) {
-      return hashesArray_[i];
-    }
+  inline void StoreKeyValue(Bucket& bucket, size_t i, KeyType&& key, ValueType&& value, std::false_type) {
+    bucket.SetKeyValue(i, std::move(key), std::move(value));
+  }
 
-    inline Cell& GetCell(size_t i) {
-      return *static_cast<Cell*>(
-      static_cast<void*>(&Cells_[i]));
+  // The value is built in the pool first and given back if the key throws.
+  inline void StoreKeyValue(Bucket& bucket, size_t i, KeyType&& key, ValueType&& value, std::true_type) {
+    ValueType* stored = NewValue(std::move(value), std::true_type());
+    try {
+      bucket.SetKeyValue(i, std::move(key), std::move(stored));
+    } catch (...) {
+      DestroyValue(stored, std::true_type());
+      FreeValue(stored, std::true_type());
+      throw;
     }
+  }
 
-    inline void SetPartialKey(size_t i, char paritialKey) {
-      hashesArray_[i] = paritialKey;
-    }
+  CuckooStatusCode CheckDuplicateBucket(size_t index_first, const KeyType& key, TagType paritialKey, int& index) {
+    Bucket bucket_first = table_.GetBucket(index_first);
 
-    inline void SetOccupiedBit(size_t i) {
-      occupied_.set(i);
+    index = FindSlot(key, paritialKey, bucket_first);
+    if (index != -1) {
+      // index is the slot of the duplicate key then.
+      return CuckooStatusCode::DUPLICATE;
     }
 
-    inline void SetKeyValue(size_t i, KeyType&& key, ValueType&& value) {
-      new (&Cells_[i]) Cell(std::move(key), std::move(value));
-    }
+    index = bucket_first.GetAvailableSlot();
+    return CuckooStatusCode::OK;
+  }
 
-    inline bool IfAvailable() {
-      for (int i = 0; i < BUCKET_SIZE; i++) {
-        if (!occupied_[i]) {
-          return true;
-        }
-      }
-      return false;
-    }
-  };
+
+  // Pick a slot to evict pseudo-randomly, so concurrent searches starting
+  // from the same bucket do not all follow the same path.
+  static inline size_t RandomSlot() {
+    static thread_local size_t seed = reinterpret_cast<size_t>(&seed);
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed % BUCKET_SIZE;
+  }
 
   /*
-   * BucketMetadata class saves the index of buckets in table, and the locks acquired if any.
-   * BucketMetadata is responsible to release locks.
+   * Breadth first search from the two full buckets of a key for the closest
+   * bucket with a free slot, following each cell to its alternative bucket.
+   * The shortest path is saved in cuckooPath from head to tail, nothing is moved yet.
+   *
+   * No lock is taken here: buckets are read racily and only their partial keys
+   * and occupied bits are used, so a stale read only produces a bad path, which
+   * SwapCuckooPath detects once it holds the locks.
    */
-  template <size_t N>
-  class BucketMetadata {
-  private:
-    static_assert(N >= 1 && N <= 3, "BucketMetadata should only be used"
-    " for between 1 and 3 locks");
+  inline CuckooStatusCode SearchCuckooPath(size_t tableSizeBase,
+                                           const TwoBucketMetadata& startBucket,
+                                           CuckooPath& cuckooPath) {
+    UnlockedReadGuard readGuard(this);
+    BfsQueue& bfsQueue = LocalBfsQueue();
+    bfsQueue.Reset();
+    bfsQueue.Push(startBucket.GetN(0), 0, 0, 0);
+    if (startBucket.GetN(1) != startBucket.GetN(0)) {
+      bfsQueue.Push(startBucket.GetN(1), 0, 0, 0);
+    }
 
-    std::array<size_t, N> indexes;
-    size_t tableSize;
-    CuckoohashingTable *map_;
-  public:
-    BucketMetadata() {}
+    while (!bfsQueue.Empty()) {
+      if (table_.GetTableSizeBase() != tableSizeBase) {
+        return CuckooStatusCode::RESIZE;
+      }
 
-    template <typename... Args>
-    BucketMetadata(CuckoohashingTable* map, Args&&... inds)
-    : map_(map), indexes{{inds...}} {}
+      uint16_t current = static_cast<uint16_t>(bfsQueue.head++);
+      const BfsNode node = bfsQueue.nodes[current];
+      Bucket bucket = table_.GetBucket(node.bucket);
 
-    BucketMetadata(const BucketMetadata& bucketMetadata) {
-      tableSize = bucketMetadata.GetTableSizeBase();
-      for (int i = 0; i < N; i++) {
-        indexes[i] = bucketMetadata.GetN(i);
-      }
-      map_ = bucketMetadata.GetMapPtr();
-    }
-    ~BucketMetadata() {
-      // Has been called Release() somewhere
-      if (map_ == nullptr) {
-        return;
+      int freeSlot = bucket.GetAvailableSlot();
+      if (freeSlot != -1) {
+        BuildCuckooPath(bfsQueue, current, cuckooPath);
+        return CuckooStatusCode::OK;
       }
 
-      Unlock();
-      map_ = nullptr;
-    }
-
-    inline void Release() {
-      this->~BucketMetadata();
-      map_ = nullptr;
-    }
+      if (node.depth >= maxStep_) {
+        continue;
+      }
 
-    inline void AddBucket(size_t i, size_t bucketPos) {
-      if (i >= N) {
-        // log error
-      } else {
-        indexes[i] = bucketPos;
+      // Start from a random slot so concurrent searches from the same bucket
+      // do not all evict the same cell.
+      size_t start = RandomSlot();
+      for (size_t i = 0; i < BUCKET_SIZE && !bfsQueue.Full(); i++) {
+        size_t slot = (start + i) % BUCKET_SIZE;
+        size_t next = AlternativeIndexOff(tableSizeBase, bucket.GetPartitialKey(slot), node.bucket);
+        if (next != node.bucket) {
+          bfsQueue.Push(next, current, static_cast<uint8_t>(slot), node.depth + 1);
+        }
       }
     }
 
-    inline void AddTableSize(size_t i) {
-      tableSize = i;
-    }
+    return CuckooStatusCode::MAXSTEP;
+  }
 
-    inline CuckoohashingTable* GetMapPtr() const {
-      return map_;
+  // Follow parents from the BFS node with a free slot back to a start bucket.
+  inline void BuildCuckooPath(const BfsQueue& bfsQueue, uint16_t tail, CuckooPath& cuckooPath) {
+    const BfsNode* node = &bfsQueue.nodes[tail];
+    cuckooPath.length = node->depth;
+    while (node->depth != 0) {
+      const BfsNode& parent = bfsQueue.nodes[node->parent];
+      cuckooPath.nodes[node->depth - 1] = CuckooPathNode{parent.bucket, node->bucket, node->slot};
+      node = &parent;
     }
+  }
 
-    inline size_t GetTableSizeBase() const {
-      return tableSize;
-    }
+  /*
+   * Move cells along cuckooPath from the tail back toward the head, so each hop
+   * fills the slot freed by the hop after it. Every hop re-locks its two buckets
+   * and checks the cell still belongs to both of them. When the whole path is
+   * moved, one slot of the head bucket is free.
+   */
+  inline CuckooStatusCode SwapCuckooPath(size_t tableSizeBase,
+                                         const CuckooPath& cuckooPath) {
+    for (size_t i = cuckooPath.length; i-- > 0; ) {
+      const CuckooPathNode* node = &cuckooPath.nodes[i];
+      if (!LockTwo(tableSizeBase, node->from, node->to)) {
+        // Table has been resized, the path is meaningless now.
+        return CuckooStatusCode::RESIZE;
+      }
+      // hop releases both locks when it goes out of scope.
+      TwoBucketMetadata hop(this, tableSizeBase, node->from, node->to);
+      MigrateIfNeeded(node->from);
+      MigrateIfNeeded(node->to);
+
+      Bucket from = table_.GetBucket(node->from);
+      Bucket to = table_.GetBucket(node->to);
+      int toSlot = to.GetAvailableSlot();
+
+      // Other threads may have changed buckets on path after search.
+      if (toSlot == -1 || !from.IfOccupied(node->slot)) {
+        return CuckooStatusCode::PATH_INVALID;
+      }
 
-    inline bool Lock() {
-      if (N == 2) {
-        return map_->LockTwo(tableSize, indexes[0], indexes[1]);
+      KeyType& key = from.GetKey(node->slot);
+      auto indexes = TwoBucketsPos(tableSizeBase, GetHashValue(key));
+      if (!(indexes.first == node->from && indexes.second == node->to) &&
+          !(indexes.first == node->to && indexes.second == node->from)) {
+        return CuckooStatusCode::PATH_INVALID;
       }
 
-      return false;
+      to.SetKeyValue(toSlot, std::move(key), std::move(from.GetStoredValue(node->slot)));
+      to.SetPartialKey(toSlot, from.GetPartitialKey(node->slot));
+      to.SetOccupiedBit(toSlot);
+      from.EraseKeyValue(node->slot);
+      from.ClearOccupiedBit(node->slot);
     }
 
-    inline void Unlock() {
-      for (int i = 0; i < N; i++) {
-        map_->Unlock(indexes[i]);
-      }
+    return CuckooStatusCode::OK;
+  }
+
+  /*
+   * Double the table. New buckets are published under all locks, which bumps
+   * the size base and so invalidates in-flight operations, then old buckets are
+   * migrated one by one, each under its own lock, so other threads keep going.
+   * In INCREMENTAL mode the migration is left to following operations.
+   */
+  void CuckooResize(size_t tableSizeBase) {
+    std::lock_guard<std::mutex> resizeGuard(resizeLock_);
+    if (table_.GetTableSizeBase() != tableSizeBase) {
+      // another thread has resized the table.
+      return;
     }
 
-    size_t inline GetN(size_t i) const {
-        return indexes[i];
+    // The last resize must be done before growing again. Operations migrate
+    // buckets much faster than they fill the table, so this is rarely needed.
+    MigrateAll();
+    FinishMigration();
+
+    // Everything is allocated before the stripes are taken, a throw under them
+    // would leave every stripe locked. resizeLock_ keeps locks_ as is.
+    std::unique_ptr<LockTable> newLocks;
+    const size_t lockSizeBase = locks_.load(std::memory_order_relaxed)->GetSizeBase();
+    if (lockSizeBase < maxLockSizeBase_) {
+      newLocks.reset(new LockTable(lockSizeBase + 1, table_.GetAllocator()));
+      retiredLocks_.reserve(retiredLocks_.size() + 1);
     }
-  };
 
-  typedef BucketMetadata<2> TwoBucketMetadata;
+    const size_t oldSize = TableSize(tableSizeBase);
+    std::unique_ptr<BucketArray> newBuckets(new BucketArray(TableSize(tableSizeBase + 1), table_.GetAllocator()));
+    std::unique_ptr<std::atomic<bool>[]> migrated(new std::atomic<bool>[oldSize]());
 
-  class Table {
-   public:
-    Table(size_t sizeBase): sizeBase_(sizeBase) {
-      size_t size = size_t(1) << sizeBase;
-      buckets_ = new Bucket[size];
+    LockTable* lockTable = LockAllStripes();
+    table_.Grow(std::move(newBuckets), std::move(migrated));
+    if (newLocks) {
+      GrowLocks(lockTable, std::move(newLocks));
+      return;
     }
+    UnlockAllStripes(lockTable);
 
-    ~Table() {
-      DeallocMem();
+    if (migrationMode_ == EAGER) {
+      MigrateAll();
+      FinishMigration();
     }
+  }
 
-    inline size_t GetTableSize() const {
-      return size_t(1) << sizeBase_.load(std::memory_order_acquire);
+  // Must be called with resizeLock_ held.
+  void MigrateAll() {
+    if (!table_.IfMigrating()) {
+      return;
     }
 
-    inline size_t GetTableSizeBase() {
-      return sizeBase_.load(std::memory_order_acquire);
+    const size_t oldSize = TableSize(table_.GetOldTableSizeBase());
+    for (size_t i = 0; i < oldSize; i++) {
+      LockOne(i);
+      MigrateBucket(i);
+      Unlock(i);
     }
+  }
 
-    Bucket& GetBucket(size_t index) {
-      return buckets_[index];
+  // Free old buckets once all of them are migrated.
+  // Must be called with resizeLock_ held.
+  void FinishMigration() {
+    if (!table_.HasOldBuckets() || !table_.IfAllMigrated()) {
+      return;
     }
 
-    class CuckooPathNode {
-    private:
-      std::unique_ptr<TwoBucketMetadata> metadataPtr;
-
-    public:
-      CuckooPathNode(size_t size, size_t i, size_t j) {
-        metadataPtr = new TwoBucketMetadata();
-        metadataPtr->AddBucket(0, i);
-        metadataPtr->AddBucket(1, j);
-        metadataPtr->AddTableSize(size);
-      }
-
-      CuckooStatusCode Swap() {
-        if (metadataPtr->Lock() == false) {
-          // If metadata lock fail, means table is been resize in this table
-          // In this case, all the key are remapped already.
-          // So cannot continue, must redo the insert.
-          return CuckooStatusCode::RESIZE;
-        }
-
+    std::atomic<bool>* migrated;
+    LockTable* lockTable = LockAllStripes();
+    BucketArray* oldBuckets = table_.DetachOldBuckets(migrated);
+    UnlockAllStripes(lockTable);
 
-        metadataPtr->Unlock();
-        return CuckooStatusCode::OK;
-      }
-    };
+    // SearchCuckooPath and optimistic lookups may still be reading the old buckets.
+    WaitForUnlockedReaders();
+    delete oldBuckets;
+    delete[] migrated;
+  }
 
-   private:
-    void DeallocMem() {
-      delete[] buckets_;
+  /*
+   * Double the lock table right after the table has grown, with all locks held.
+   * With twice the stripes, new bucket i + old size no longer shares the stripe
+   * of old bucket i, so old buckets are all migrated here before the locks are
+   * released instead of one stripe at a time. This only happens while the
+   * table is smaller than the largest lock table, so the pause is short.
+   */
+  void GrowLocks(LockTable* lockTable, std::unique_ptr<LockTable> newLocks) {
+    const size_t oldSize = TableSize(table_.GetOldTableSizeBase());
+    for (size_t i = 0; i < oldSize; i++) {
+      MigrateBucket(i);
     }
 
-    std::atomic<size_t> sizeBase_;
-    Bucket *buckets_;
-  };
-
-  inline size_t GetHashValue(const KeyType& key) const {
-    return Hasher_(key);
+    std::atomic<bool>* migrated;
+    BucketArray* oldBuckets = table_.DetachOldBuckets(migrated);
+    locks_.store(newLocks.release(), std::memory_order_release);
+    // Optimistic readers may still read versions of the old stripes, the
+    // room for it is reserved by CuckooResize.
+    retiredLocks_.emplace_back(lockTable);
+    UnlockAllStripes(lockTable);
+
+    WaitForUnlockedReaders();
+    delete oldBuckets;
+    delete[] migrated;
   }
 
-  inline std::pair<size_t, size_t> GetTwoIndexes(const size_t hashValue) const {
-    const size_t curTableSize = table_.GetTableSize();
-    size_t pos1 = hashValue % curTableSize;
-    // 0xc6a4a7935bd1e995 is the hash constant from 64-bit MurmurHash2
-    size_t pos2 = (hashValue & 0xf) * 0xc6a4a7935bd1e995 % curTableSize;
-
-    return std::pair<size_t, size_t>(pos1, pos2);
+  // In INCREMENTAL mode every operation migrates a few old buckets before it
+  // runs, until the old buckets are freed. Must be called without any lock held.
+  inline void MigrateStep() {
+    if (migrationMode_ == INCREMENTAL && table_.HasOldBuckets()) {
+      MigrateSome();
+    }
   }
 
-  bool LookupOneBucket(const KeyType& key, size_t index) {
-    Bucket& bucket = table_.GetBucket(index);
+  /*
+   * The thread migrating the last old bucket frees the old buckets, waiting
+   * for a resize or a scan holding resizeLock_ if needed. If an insert or
+   * erase migrated it under its bucket locks instead, which must not wait for
+   * resizeLock_, following operations try to free them.
+   */
+  void MigrateSome() {
+    bool last = false;
+    if (table_.IfMigrating()) {
+      size_t begin = table_.ClaimOldBuckets(MIGRATE_BUCKETS_PER_OP);
+      for (size_t i = begin; i < begin + MIGRATE_BUCKETS_PER_OP; i++) {
+        // Only a hint, it is checked again under the lock.
+        if (i >= TableSize(table_.GetOldTableSizeBase())) {
+          break;
+        }
+
+        LockOne(i);
+        // Old buckets may have been freed or replaced since they were claimed.
+        bool inRange = table_.IfMigrating() && i < TableSize(table_.GetOldTableSizeBase());
+        if (inRange) {
+          last = MigrateBucket(i) || last;
+        }
+        Unlock(i);
 
-    for (size_t i = 0; i < BUCKET_SIZE; i++) {
-      if (!bucket.IfOccupied(i)) {
-        continue;
+        if (!inRange) {
+          break;
+        }
       }
+    }
 
-      // compare keys
-      if (keyEqualChekcer(bucket.GetCell(i).first, key) == true) {
-        return true;
+    if (last) {
+      std::lock_guard<std::mutex> resizeGuard(resizeLock_);
+      FinishMigration();
+    } else if (table_.IfAllMigrated()) {
+      // Whoever holds resizeLock_ is resizing or finishing migration already.
+      std::unique_lock<std::mutex> resizeGuard(resizeLock_, std::try_to_lock);
+      if (resizeGuard.owns_lock()) {
+        FinishMigration();
       }
     }
-
-    return false;
-  }
-
-  bool CuckooLookupLoop(const KeyType& key) {
-      //auto indexes = TwoBucketsPos(GetHashValue(key));
-      auto indexes = SnapshotAndLockTwo(GetHashValue(key));
-      // lock should be released after this return.
-      // because local variable is saved in stack.
-      // indexes should be destructed after return.
-      return CuckooLookup(key, indexes);
   }
 
-  bool CuckooLookup(const KeyType& key,
-                    const TwoBucketMetadata& indexes) {
-    if (LookupOneBucket(key, indexes.GetN(0))) {
-      return true;
+  /*
+   * Move the cells of old bucket index to new buckets index and index + old
+   * size, keeping their slots. Nothing else writes to these new buckets before
+   * this old bucket is migrated, so the slots are always free.
+   * Must be called with the lock of the bucket held. return true if it was
+   * the last old bucket to migrate.
+   */
+  bool MigrateBucket(size_t index) {
+    if (!table_.IfMigrating() || table_.IfMigrated(index)) {
+      return false;
     }
 
-    if (LookupOneBucket(key, indexes.GetN(1))) {
-      return true;
+    const size_t oldSizeBase = table_.GetOldTableSizeBase();
+    const size_t newSizeBase = table_.GetTableSizeBase();
+    Bucket oldBucket = table_.GetOldBucket(index);
+    uint32_t occupied = oldBucket.GetOccupiedMask();
+    while (occupied != 0) {
+      const size_t i = PopLowestBit(occupied);
+      size_t hashValue = GetHashValue(oldBucket.GetKey(i));
+      // keep the cell at primary bucket if it was at primary bucket,
+      // otherwise at alternative bucket.
+      auto newIndexes = TwoBucketsPos(newSizeBase, hashValue);
+      size_t newIndex = IndexOff(oldSizeBase, hashValue) == index ?
+                        newIndexes.first : newIndexes.second;
+
+      Bucket newBucket = table_.GetBucket(newIndex);
+      newBucket.SetKeyValue(i, std::move(oldBucket.GetKey(i)), std::move(oldBucket.GetStoredValue(i)));
+      newBucket.SetPartialKey(i, oldBucket.GetPartitialKey(i));
+      newBucket.SetOccupiedBit(i);
+      oldBucket.EraseKeyValue(i);
+      oldBucket.ClearOccupiedBit(i);
     }
 
-    return false;
+    return table_.SetMigrated(index);
   }
 
-  CuckooStatusCode InsertOneBucket(size_t i, size_t index, char paritialKey, KeyType&& key, ValueType&& value) {
-      Bucket& bucket = table_.GetBucket(index);
-
-    bucket.SetOccupiedBit(i);
-    bucket.SetPartialKey(i, paritialKey);
-    bucket.SetKeyValue(i, std::forward<KeyType>(key), std::forward<ValueType>(value));
-
-    return CuckooStatusCode::INSERT;
+  // A bucket has to be migrated before it is modified.
+  inline void MigrateIfNeeded(size_t index) {
+    if (table_.IfMigrating()) {
+      MigrateBucket(index & HashMask(table_.GetOldTableSizeBase()));
+    }
   }
 
-  CuckooStatusCode CheckDuplicateBucket(size_t index_first, const KeyType& key, int& index) {
-    Bucket &bucket_first = table_.GetBucket(index_first);
-
-    index = -1;
-    for (size_t i = 0; i < BUCKET_SIZE; i++) {
-      if (bucket_first.IfOccupied(i)) {
-        Cell &cell = bucket_first.GetCell(i);
-        if (keyEqualChekcer(cell.first, key)) {
-          return CuckooStatusCode::DUPLICATE;
-        }
-      } else if (index == -1) {
-        index = i;
-      }
+  // Readers look into the old bucket until it is migrated.
+  inline Bucket GetBucketForRead(size_t index) {
+    Bucket bucket = table_.GetBucket(index);
+    if (table_.IfMigrating()) {
+      table_.GetUnmigratedOldBucket(index, bucket);
     }
-
-    return CuckooStatusCode::OK;
+    return bucket;
   }
 
+  bool CuckooInsertLoop(size_t hashValue, KeyType&& key, ValueType&& value) {
+    MigrateStep();
 
-  inline CuckooStatusCode SearchCuckooPath(size_t tableSizeBase,
-                                           const TwoBucketMetadata& startBucket,
-                                           std::queue<TwoBucketMetadata>& bucketQueue) {
-    int depth = 2;
-    bucketQueue.push(TwoBucketMetadata(startBucket));
-
-    while (depth <= MAX_STEP) {
-      TwoBucketMetadata& twoBucketMetadata = bucketQueue.back();
-      size_t bucketIndex = twoBucketMetadata.GetN(1);
-      LockOne(bucketIndex);
-
-      // Poll last node from queue and get the second bucket index.
-      // Based on second bucket index, find another bucket wihch is not equal to the first bucket index,
-      // and that can move node, then create a CuckooPathNode, push the node to the end of queue.
-
-      // check here if after lock the table has been resize.
-      if (table_.GetTableSizeBase() != tableSizeBase) {
-        Unlock(bucketIndex);
-        return CuckooStatusCode::RESIZE;
-      }
+    TwoBucketMetadata indexes;
+    size_t bucketIndex;
+    int slot;
+    if (CuckooFindInsertSlot(hashValue, key, indexes, bucketIndex, slot) ==
+        CuckooStatusCode::DUPLICATE) {
+      return false;
+    }
 
-      // then what should be the next bucket?
-      // the first choice is a bucket with empty slots, if find it, stop search and return, ready to swap.
-      // If not, find a full bucket (in order or randomly), push to the end of queue, continue util depth exceeds threshold.
-
-      // try to find a bucket with empty slot.
-      Bucket& bucket = table_.GetBucket(twoBucketMetadata.GetN(1));
-      for (int i = 0; i < BUCKET_SIZE; i++) {
-        char partialKey = bucket.GetPartitialKey(i);
-        size_t pairIndex = AlternativeIndexOff(tableSizeBase, partialKey, bucketIndex);
-
-        LockOne(pairIndex);
-        // do not need to check tableSizeBase again because we have acquired a lock before.
-        if (table_.GetBucket(pairIndex).IfAvailable()) {
-          bucketQueue.push(TwoBucketMetadata{this, bucketIndex, pairIndex});
-          UnlockTwo(bucketIndex, pairIndex);
-          return CuckooStatusCode::OK;
-        } else if (i == BUCKET_SIZE - 1){
-          // last slot checked, no available buckets.
-          // better do random here, but not just do last one.
-          bucketQueue.push(TwoBucketMetadata{this, bucketIndex, pairIndex});
-        }
+    InsertOneBucket(slot,
+                    bucketIndex,
+                    PartialHashValue(hashValue),
+                    std::forward<KeyType>(key),
+                    std::forward<ValueType>(value));
+    indexes.Release();
+    AddEntries(1);
+    return true;
+  }
 
-        Unlock(pairIndex);
-      }
+  // Call fn on the value of key if found, insert key with value otherwise.
+  // Both happen under the same two bucket locks.
+  template <typename Fn>
+  bool CuckooUpsertLoop(KeyType&& key, Fn& fn, ValueType&& value) {
+    MigrateStep();
+    const size_t hashValue = GetHashValue(key);
 
-      Unlock(bucketIndex);
+    TwoBucketMetadata indexes;
+    size_t bucketIndex;
+    int slot;
+    if (CuckooFindInsertSlot(hashValue, key, indexes, bucketIndex, slot) ==
+        CuckooStatusCode::DUPLICATE) {
+      fn(table_.GetBucket(bucketIndex).GetValue(slot));
+      return false;
     }
 
-    return CuckooStatusCode::MAXSTEP;
+    InsertOneBucket(slot,
+                    bucketIndex,
+                    PartialHashValue(hashValue),
+                    std::forward<KeyType>(key),
+                    std::forward<ValueType>(value));
+    indexes.Release();
+    AddEntries(1);
+    return true;
   }
 
-  inline CuckooStatusCode SwapCuckooPath(std::queue<TwoBucketMetadata>& bucketQueue) {
+  // Call fn on the value of key with its buckets locked for writing.
+  template <typename Fn>
+  bool CuckooUpdateLoop(const KeyType& key, Fn& fn) {
+    MigrateStep();
+    const size_t hashValue = GetHashValue(key);
+    auto indexes = SnapshotAndLockTwo(hashValue);
+    for (size_t i = 0; i < 2; i++) {
+      MigrateIfNeeded(indexes.GetN(i));
+      Bucket bucket = table_.GetBucket(indexes.GetN(i));
+      int slot = FindSlot(key, PartialHashValue(hashValue), bucket);
+      if (slot != -1) {
+        fn(bucket.GetValue(slot));
+        return true;
+      }
+    }
 
+    return false;
   }
 
-  bool CuckooInsertLoop(KeyType&& key, ValueType&& value) {
-    const size_t hashValue = GetHashValue(key);
+  /*
+   * Lock the two buckets of key and look for key in them.
+   * return DUPLICATE if key is found at (bucketIndex, slot).
+   * return INSERT if (bucketIndex, slot) is a free slot for key, after making
+   * room with cuckoo moves or a resize when both buckets are full.
+   * indexes holds the two bucket locks in both cases.
+   */
+  CuckooStatusCode CuckooFindInsertSlot(size_t hashValue,
+                                        const KeyType& key,
+                                        TwoBucketMetadata& indexes,
+                                        size_t& bucketIndex,
+                                        int& slot) {
+    CuckooPath& cuckooPath = LocalCuckooPath();
 
     while (true) {
       try {
-        auto indexes = SnapshotAndLockTwo(hashValue);
+        indexes = SnapshotAndLockTwo(hashValue);
 
         // Acquired two locks, start insert now.
+        MigrateIfNeeded(indexes.GetN(0));
+        MigrateIfNeeded(indexes.GetN(1));
+
         CuckooStatusCode code;
         int index1, index2;
-        code = CheckDuplicateBucket(indexes.GetN(0), key, index1);
+        code = CheckDuplicateBucket(indexes.GetN(0), key, PartialHashValue(hashValue), index1);
 
         if (code == CuckooStatusCode::DUPLICATE) {
-          return false;
+          bucketIndex = indexes.GetN(0);
+          slot = index1;
+          return code;
         }
 
-        code = CheckDuplicateBucket(indexes.GetN(1), key, index1);
+        code = CheckDuplicateBucket(indexes.GetN(1), key, PartialHashValue(hashValue), index2);
 
         if (code == CuckooStatusCode::DUPLICATE) {
-          return false;
+          bucketIndex = indexes.GetN(1);
+          slot = index2;
+          return code;
         }
 
         if (index1 != -1) {
-          InsertOneBucket(index1,
-                          indexes.GetN(0),
-                          PartialHashValue(hashValue),
-                          std::forward<KeyType>(key),
-                          std::forward<ValueType>(value));
-
+          bucketIndex = indexes.GetN(0);
+          slot = index1;
+          return CuckooStatusCode::INSERT;
         } else if (index2 != -1) {
-          InsertOneBucket(index2,
-                          indexes.GetN(1),
-                          PartialHashValue(hashValue),
-                          std::forward<KeyType>(key),
-                          std::forward<ValueType>(value));
-        } else {
-
-          // Cuckoo search path and cuckoo move
-          // If done this part, then insert is done.
-          // else need to resize table
-          // Has to RELEASE locks above.
-
-          // release locks
-          indexes.Release();
-          std::queue<TwoBucketMetadata> bucketQueue;
-
-          CuckooStatusCode code = SearchCuckooPath(indexes.GetTableSizeBase(), indexes, bucketQueue);
-
-          if (code == CuckooStatusCode::MAXSTEP || code == CuckooStatusCode::FULL) {
-            // do resize
-            // and the throw a exception to restart
-            // but how to make sure multi threads reszie the table at the same time.
-            // hint: do check on tableSize when acquire all locks.
+          bucketIndex = indexes.GetN(1);
+          slot = index2;
+          return CuckooStatusCode::INSERT;
+        }
 
-            // resize here
+        // Cuckoo search path and cuckoo move
+        // If done this part, then insert is done.
+        // else need to resize table
+        // Has to RELEASE locks above.
 
+        // release locks
+        indexes.Release();
 
-            // then throw exception, aka retry.
-            throw TableSizeException();
-          } else if (code == CuckooStatusCode::OK) {
-            SwapCuckooPath(bucketQueue);
-          } else {
-            // what chould this one be?
-            // Possible no other .
-          }
+        code = SearchCuckooPath(indexes.GetTableSizeBase(), indexes, cuckooPath);
+
+        if (code == CuckooStatusCode::MAXSTEP || code == CuckooStatusCode::FULL) {
+          // do resize
+          // and the throw a exception to restart
+          // resizes are serialized in CuckooResize, and a resize that finds
+          // the table already grown does nothing.
+          CuckooResize(indexes.GetTableSizeBase());
+
+          // then throw exception, aka retry.
+          throw TableSizeException();
+        } else if (code == CuckooStatusCode::OK) {
+          // If the path is moved, there is a free slot in one of the two buckets now.
+          // Another thread may still take it, or change the path before it is moved,
+          // so always retry the insert from the beginning.
+          SwapCuckooPath(indexes.GetTableSizeBase(), cuckooPath);
         }
 
-        // Release the acquired locks at the beginning of loop.
-        indexes.Release();
-        return true;
+        // RESIZE: table changed during search, retry with new table.
       } catch(TableSizeException) {
         continue;
       }
@@ -513,42 +2320,39 @@ class CuckoohashingTable {
       return TableSize(tableSizeBase) - 1;
   }
 
-  inline char PartialHashValue(size_t hashValue) {
-      return (char)(hashValue >> (sizeof(size_t) - sizeof(char)) * 8);
+  // Tag is the top bits of the hash, independent of the low bits indexing buckets.
+  inline TagType PartialHashValue(size_t hashValue) {
+      return static_cast<TagType>(hashValue >> (sizeof(size_t) - sizeof(TagType)) * 8);
   }
 
   inline size_t IndexOff(size_t tableSizeBase, size_t hashValue) {
       return hashValue & HashMask(tableSizeBase);
   }
 
-  inline size_t AlternativeIndexOff(size_t tableSizeBase, char partialHashValue, size_t pos) {
-      char nonZeroTag = (partialHashValue >> 1 << 1) + 1;
-      size_t hashOfTag = static_cast<size_t >(nonZeroTag * 0xc6a4a7935bd1e995);
+  // The alternative of the alternative is pos again, so a cell can be moved
+  // back and forth knowing only its bucket and partial key. All bits of the
+  // partial key select the offset, which is odd so the two buckets always differ.
+  // 0xc6a4a7935bd1e995 is the hash constant from 64-bit MurmurHash2.
+  inline size_t AlternativeIndexOff(size_t tableSizeBase, TagType partialHashValue, size_t pos) {
+      const size_t oddTag = (static_cast<size_t>(partialHashValue) << 1) | 1;
+      size_t hashOfTag = oddTag * 0xc6a4a7935bd1e995ULL;
       return (pos ^ hashOfTag) & HashMask(tableSizeBase);
   }
 
-  std::pair<size_t, size_t> TwoBucketsPos(size_t hashValue) {
-    size_t posFirst = IndexOff(table_.GetTableSizeBase(), hashValue);
-    char paritial = PartialHashValue(hashValue);
-    size_t posSecond = AlternativeIndexOff(table_.GetTableSizeBase(), paritial, posFirst);
+  std::pair<size_t, size_t> TwoBucketsPos(size_t tableSizeBase, size_t hashValue) {
+    size_t posFirst = IndexOff(tableSizeBase, hashValue);
+    TagType paritial = PartialHashValue(hashValue);
+    size_t posSecond = AlternativeIndexOff(tableSizeBase, paritial, posFirst);
     return std::pair<size_t, size_t>(posFirst, posSecond);
   };
 
   TwoBucketMetadata SnapshotAndLockTwo(size_t hashValue) {
     while (true) {
       size_t tableSizeBase = table_.GetTableSizeBase();
-      size_t posFirst = IndexOff(tableSizeBase, hashValue);
-      char paritial = PartialHashValue(hashValue);
-      size_t posSecond = AlternativeIndexOff(tableSizeBase, paritial, posFirst);
-
-
-      TwoBucketMetadata metadata;
-      metadata.AddBucket(0, posFirst);
-      metadata.AddBucket(1, posSecond);
-      metadata.AddTableSize(tableSizeBase);
+      auto indexes = TwoBucketsPos(tableSizeBase, hashValue);
 
       try {
-        return LockTwoAndReturnMetadata(tableSizeBase, posFirst, posSecond);
+        return LockTwoAndReturnMetadata(tableSizeBase, indexes.first, indexes.second);
       } catch (TableSizeException) {
         continue;
       }
@@ -556,77 +2360,174 @@ class CuckoohashingTable {
   };
 
   TwoBucketMetadata LockTwoAndReturnMetadata(size_t tableSizeBase, size_t posFirst, size_t posSecond) {
-    if (posFirst > posSecond) {
-      std::swap(posFirst, posSecond);
+    if (!LockTwo(tableSizeBase, posFirst, posSecond)) {
+      throw TableSizeException();
     }
+    return TwoBucketMetadata{this, tableSizeBase, posFirst, posSecond};
+  }
 
-    locks_[posFirst].lock();
-    CheckTableSize(tableSizeBase, posFirst);
-    locks_[posSecond].lock();
-    return TwoBucketMetadata{this, posFirst, posSecond};
+  // Only valid while holding a stripe: a lock table is replaced with all of
+  // its stripes held, so it stays current as long as one of them is held.
+  inline size_t LockIndex(size_t bucketIndex) const {
+    return locks_.load(std::memory_order_relaxed)->StripeIndex(bucketIndex);
   }
 
-  void CheckTableSize(size_t tableSize, size_t lockIndex) {
-    if (table_.GetTableSizeBase() != tableSize) {
-      locks_[lockIndex].unlock();
-      throw TableSizeException();
-    }
+  inline LockStripe& GetLock(size_t bucketIndex) {
+    LockTable* lockTable = locks_.load(std::memory_order_relaxed);
+    return lockTable->GetStripe(lockTable->StripeIndex(bucketIndex));
   }
 
+  // Locks are always taken in index order to avoid deadlock between threads
+  // locking overlapping buckets, and a lock shared by both buckets is taken once.
+  // return false if the table or the lock table changed before the locks are held.
   bool LockTwo(size_t tableSizeBase, size_t posFirst, size_t posSecond) {
-    locks_[posFirst].lock();
-    if (table_.GetTableSizeBase() != tableSizeBase) {
-      locks_[posFirst].unlock();
+    LockTable* lockTable = locks_.load(std::memory_order_acquire);
+    size_t lockFirst = lockTable->StripeIndex(posFirst);
+    size_t lockSecond = lockTable->StripeIndex(posSecond);
+    if (lockFirst > lockSecond) {
+      std::swap(lockFirst, lockSecond);
+    }
+
+    lockTable->GetStripe(lockFirst).lock();
+    if (table_.GetTableSizeBase() != tableSizeBase ||
+        locks_.load(std::memory_order_acquire) != lockTable) {
+      lockTable->GetStripe(lockFirst).unlock();
       return false;
     }
 
-    locks_[posSecond].lock();
+    if (lockSecond != lockFirst) {
+      lockTable->GetStripe(lockSecond).lock();
+    }
 
     return true;
   }
 
-  inline void UnlockTwo(size_t i, size_t j) {
-    locks_[i].unlock();
-    locks_[j].unlock();
+  // Same as LockTwo, in shared mode.
+  bool LockTwoShared(size_t tableSizeBase, size_t posFirst, size_t posSecond) {
+    LockTable* lockTable = locks_.load(std::memory_order_acquire);
+    size_t lockFirst = lockTable->StripeIndex(posFirst);
+    size_t lockSecond = lockTable->StripeIndex(posSecond);
+    if (lockFirst > lockSecond) {
+      std::swap(lockFirst, lockSecond);
+    }
+
+    lockTable->GetStripe(lockFirst).lock_shared();
+    if (table_.GetTableSizeBase() != tableSizeBase ||
+        locks_.load(std::memory_order_acquire) != lockTable) {
+      lockTable->GetStripe(lockFirst).unlock_shared();
+      return false;
+    }
+
+    if (lockSecond != lockFirst) {
+      lockTable->GetStripe(lockSecond).lock_shared();
+    }
+
+    return true;
   }
 
-  bool Unlock(TwoBucketMetadata& twoBucketMetadata) {
-    locks_[twoBucketMetadata.GetN(0)].unlock();
-    locks_[twoBucketMetadata.GetN(1)].unlock();
+  inline void UnlockTwoShared(size_t i, size_t j) {
+    GetLock(i).unlock_shared();
+    if (LockIndex(j) != LockIndex(i)) {
+      GetLock(j).unlock_shared();
+    }
   }
 
-  bool LockTwo(size_t tableSizeBase, TwoBucketMetadata& twoBucketMetadata) {
-    locks_[twoBucketMetadata.GetN(0)].lock();
-    if (table_.GetTableSizeBase() != tableSizeBase) {
-      locks_[twoBucketMetadata.GetN(0)].unlock();
-      return false;
+  inline void UnlockTwo(size_t i, size_t j) {
+    GetLock(i).unlock();
+    if (LockIndex(j) != LockIndex(i)) {
+      GetLock(j).unlock();
     }
+  }
 
-    locks_[twoBucketMetadata.GetN(1)].lock();
+  void Unlock(TwoBucketMetadata& twoBucketMetadata) {
+    UnlockTwo(twoBucketMetadata.GetN(0), twoBucketMetadata.GetN(1));
+  }
 
-    return true;
+  bool LockTwo(size_t tableSizeBase, TwoBucketMetadata& twoBucketMetadata) {
+    return LockTwo(tableSizeBase, twoBucketMetadata.GetN(0), twoBucketMetadata.GetN(1));
   }
 
-  bool LockOne(size_t i) {
-    locks_[i].lock();
+  void LockOne(size_t i) {
+    while (true) {
+      LockTable* lockTable = locks_.load(std::memory_order_acquire);
+      LockStripe& lock = lockTable->GetStripe(lockTable->StripeIndex(i));
+      lock.lock();
+      if (locks_.load(std::memory_order_acquire) == lockTable) {
+        return;
+      }
+      lock.unlock();
+    }
   }
 
-  void LockAll() {
+  // Must be called with resizeLock_ held, which keeps the lock table from
+  // being replaced. return the lock table to pass to UnlockAllStripes.
+  LockTable* LockAllStripes() {
+    LockTable* lockTable = locks_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < lockTable->GetSize(); i++) {
+      lockTable->GetStripe(i).LockNotElided();
+    }
+    return lockTable;
+  }
+
+  void UnlockAllStripes(LockTable* lockTable) {
+    for (size_t i = 0; i < lockTable->GetSize(); i++) {
+      lockTable->GetStripe(i).unlock();
+    }
   }
 
   void inline Unlock(size_t i) {
-    locks_[i].unlock();
+    GetLock(i).unlock();
   }
 
 private:
+    // declared before table_, cells may point into it until table_ is destroyed.
+    typename std::conditional<OUT_OF_LINE_VALUES, SlabPool<ValueType>, NoValuePool>::type valuePool_;
+
     Table table_;
 
     KeyEqualChekcer keyEqualChekcer;
 
-    typedef KeyHahser Hasher_;
+    KeyHahser keyHasher;
+
+    const MigrationMode migrationMode_;
+
+    const size_t maxStep_;
+
+    // lock table grows with the table up to this size base.
+    const size_t maxLockSizeBase_;
 
-    std::array<Spinlock, BUCKET_NUM> locks_;
+    std::atomic<LockTable*> locks_;
+
+    // lock tables replaced by larger ones, guarded by resizeLock_.
+    std::vector<std::unique_ptr<LockTable>> retiredLocks_;
+
+    // serializes resizes.
+    std::mutex resizeLock_;
+
+    // come from the allocator of the buckets, like the lock stripes.
+    std::vector<ReaderSlot, ReaderSlotAllocator> readerSlots_;
 };
+
+template <typename KeyType, typename ValueType, class KeyHahser, class KeyEqualChekcer,
+          size_t SLOT_PER_BUCKET, class LockType, typename TagType, bool OUT_OF_LINE_VALUES,
+          class Allocator, bool COMPACT_CELLS>
+constexpr size_t CuckoohashingTable<KeyType, ValueType, KeyHahser, KeyEqualChekcer, SLOT_PER_BUCKET,
+                                    LockType, TagType, OUT_OF_LINE_VALUES, Allocator,
+                                    COMPACT_CELLS>::BUCKET_SIZE;
+
+template <typename KeyType, typename ValueType, class KeyHahser, class KeyEqualChekcer,
+          size_t SLOT_PER_BUCKET, class LockType, typename TagType, bool OUT_OF_LINE_VALUES,
+          class Allocator, bool COMPACT_CELLS>
+constexpr size_t CuckoohashingTable<KeyType, ValueType, KeyHahser, KeyEqualChekcer, SLOT_PER_BUCKET,
+                                    LockType, TagType, OUT_OF_LINE_VALUES, Allocator,
+                                    COMPACT_CELLS>::DEFAULT_MAX_STEP;
+
+template <typename KeyType, typename ValueType, class KeyHahser, class KeyEqualChekcer,
+          size_t SLOT_PER_BUCKET, class LockType, typename TagType, bool OUT_OF_LINE_VALUES,
+          class Allocator, bool COMPACT_CELLS>
+constexpr size_t CuckoohashingTable<KeyType, ValueType, KeyHahser, KeyEqualChekcer, SLOT_PER_BUCKET,
+                                    LockType, TagType, OUT_OF_LINE_VALUES, Allocator,
+                                    COMPACT_CELLS>::MAX_STEP_LIMIT;
 }  // namespace concurrent_lib
 
 #endif //CONCURRENTLIB_CUCOOHASHINGTABLE_H
\ No newline at end of file
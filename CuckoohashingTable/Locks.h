@@ -0,0 +1,588 @@
+//
+// Lock policies for the bucket lock stripes of CuckoohashingTable. Each of
+// them provides lock(), unlock() and try_lock(), and unlock() is always called
+// by the thread that locked.
+//
+
+#ifndef CONCURRENTLIB_LOCKS_H
+#define CONCURRENTLIB_LOCKS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CONCURRENTLIB_RTM 1
+#include <cpuid.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace concurrent_lib {
+
+// Tell the core this is a spin-wait loop, so it yields pipeline resources to
+// the sibling hyperthread and does not flood the memory bus.
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Backoff spins for exponentially longer pauses, then gives up the time slice,
+ * so a waiter does not starve the lock holder when threads outnumber cores.
+ */
+class Backoff {
+ private:
+  static const size_t MAX_PAUSES = 1024;
+  size_t pauses_;
+
+ public:
+  Backoff(): pauses_(1) {}
+
+  inline void Pause() {
+    if (pauses_ > MAX_PAUSES) {
+      std::this_thread::yield();
+      return;
+    }
+
+    for (size_t i = 0; i < pauses_; i++) {
+      CpuRelax();
+    }
+    pauses_ <<= 1;
+  }
+};
+
+// Test-and-set loop, every waiter keeps writing the lock's cache line.
+class Spinlock {
+ private:
+  std::atomic_flag lock_;
+ public:
+  Spinlock() {
+    lock_.clear();
+  }
+
+  inline void lock() {
+    while (lock_.test_and_set(std::memory_order_acquire));
+  }
+
+  inline void unlock() {
+    lock_.clear(std::memory_order_release);
+  }
+
+  inline bool try_lock() {
+    return !lock_.test_and_set(std::memory_order_acquire);
+  }
+};
+
+// Test-and-test-and-set, waiters spin on a shared copy of the cache line
+// and only write to it once the lock looks free.
+class TTASSpinlock {
+ private:
+  std::atomic<bool> locked_;
+ public:
+  TTASSpinlock(): locked_(false) {}
+
+  inline void lock() {
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+      while (locked_.load(std::memory_order_relaxed)) {
+        CpuRelax();
+      }
+    }
+  }
+
+  inline void unlock() {
+    locked_.store(false, std::memory_order_release);
+  }
+
+  inline bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+};
+
+// Test-and-test-and-set with exponential backoff between attempts.
+class BackoffSpinlock {
+ private:
+  std::atomic<bool> locked_;
+ public:
+  BackoffSpinlock(): locked_(false) {}
+
+  inline void lock() {
+    Backoff backoff;
+    while (locked_.load(std::memory_order_relaxed) ||
+           locked_.exchange(true, std::memory_order_acquire)) {
+      backoff.Pause();
+    }
+  }
+
+  inline void unlock() {
+    locked_.store(false, std::memory_order_release);
+  }
+
+  inline bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+};
+
+class Mutexlock {
+ private:
+  std::mutex lock_;
+
+ public:
+  inline void lock() {
+    lock_.lock();
+  }
+
+  inline void unlock() {
+    lock_.unlock();
+  }
+
+  inline bool try_lock() {
+    return lock_.try_lock();
+  }
+};
+
+/*
+ * Restricted transactional memory (Intel TSX). Support is detected at run
+ * time with CPUID, the instructions are only compiled into the functions below,
+ * so the library builds and runs without -mrtm and on CPUs without TSX.
+ */
+static const unsigned RTM_STARTED = ~0u;
+
+#if defined(CONCURRENTLIB_RTM)
+static inline bool DetectRtm() {
+  unsigned eax, ebx, ecx, edx;
+  // leaf 7, EBX bit 11.
+  return __get_cpuid_max(0, nullptr) >= 7 &&
+         __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 11)) != 0;
+}
+
+static inline bool RtmSupported() {
+  static const bool supported = DetectRtm();
+  return supported;
+}
+
+// return RTM_STARTED inside the transaction, or the abort status after it aborted.
+__attribute__((target("rtm"))) static inline unsigned RtmBegin() {
+  return _xbegin();
+}
+
+__attribute__((target("rtm"))) static inline void RtmEnd() {
+  _xend();
+}
+
+// Abort because a lock is held, the fallback path waits for it.
+__attribute__((target("rtm"))) static inline void RtmAbortLocked() {
+  _xabort(0xff);
+}
+
+__attribute__((target("rtm"))) static inline bool RtmActive() {
+  return _xtest() != 0;
+}
+
+static inline bool RtmAbortedByLock(unsigned status) {
+  return (status & _XABORT_EXPLICIT) != 0 && _XABORT_CODE(status) == 0xff;
+}
+
+// Conflicts may go away on retry, capacity overflow or a system call would abort again.
+static inline bool RtmMayRetry(unsigned status) {
+  return (status & _XABORT_RETRY) != 0;
+}
+#else
+static inline bool RtmSupported() {
+  return false;
+}
+
+static inline unsigned RtmBegin() {
+  return 0;
+}
+
+static inline void RtmEnd() {}
+
+static inline void RtmAbortLocked() {}
+
+static inline bool RtmActive() {
+  return false;
+}
+
+static inline bool RtmAbortedByLock(unsigned) {
+  return false;
+}
+
+static inline bool RtmMayRetry(unsigned) {
+  return false;
+}
+#endif
+
+/*
+ * ElidedSpinlock elides the lock with a hardware transaction when the CPU has
+ * RTM: lock() starts a transaction and only reads the lock word, so threads
+ * working on different data in the same stripe run in parallel, and a
+ * conflict rolls back to lock(), which retries a few times and then takes the
+ * lock for real like BackoffSpinlock. Locks taken while a transaction runs
+ * nest into it, the outermost unlock() commits. Without RTM it is a
+ * BackoffSpinlock. A critical section must not write data every other one
+ * writes too, such as a counter, or they all conflict, and must not pause or
+ * yield, which aborts. LockNotElided() takes the lock for real, for sections
+ * too large or too slow for a transaction.
+ */
+class ElidedSpinlock {
+ private:
+  static const size_t MAX_TRANSACTION_RETRY = 3;
+  std::atomic<bool> locked_;
+
+  inline bool LockElided() {
+    for (size_t i = 0; i < MAX_TRANSACTION_RETRY; i++) {
+      unsigned status = RtmBegin();
+      if (status == RTM_STARTED) {
+        // the lock word joins the read set, taking the lock aborts us.
+        if (!locked_.load(std::memory_order_relaxed)) {
+          return true;
+        }
+        RtmAbortLocked();
+      }
+
+      if (!RtmAbortedByLock(status) && !RtmMayRetry(status)) {
+        return false;
+      }
+      while (locked_.load(std::memory_order_relaxed)) {
+        CpuRelax();
+      }
+    }
+    return false;
+  }
+
+ public:
+  ElidedSpinlock(): locked_(false) {}
+
+  inline void lock() {
+    if (RtmSupported() && LockElided()) {
+      return;
+    }
+    LockNotElided();
+  }
+
+  inline void LockNotElided() {
+    Backoff backoff;
+    while (locked_.load(std::memory_order_relaxed) ||
+           locked_.exchange(true, std::memory_order_acquire)) {
+      backoff.Pause();
+    }
+  }
+
+  // The lock word is free only if this lock was elided.
+  inline void unlock() {
+    if (!locked_.load(std::memory_order_relaxed) && RtmActive()) {
+      RtmEnd();
+      return;
+    }
+    locked_.store(false, std::memory_order_release);
+  }
+
+  inline bool try_lock() {
+    return !locked_.load(std::memory_order_relaxed) &&
+           !locked_.exchange(true, std::memory_order_acquire);
+  }
+};
+
+// Lock policies whose critical sections may run as hardware transactions.
+template <typename Lock>
+struct IsElidedLock : std::false_type {};
+
+template <>
+struct IsElidedLock<ElidedSpinlock> : std::true_type {};
+
+/*
+ * QueueNodePool keeps the free queue nodes of a thread. A thread may hold many
+ * queue locks at once (a resize holds all stripes), so nodes are taken from
+ * the pool per acquisition instead of using one node per thread. Nodes are
+ * never freed while the process runs: CLHLock::try_lock reads a node it does
+ * not own, so the pool of an exiting thread hands its nodes to a shared list
+ * other threads take them from.
+ */
+template <typename Node>
+class QueueNodePool {
+ public:
+  static Node* New() {
+    void* memory = nullptr;
+    if (posix_memalign(&memory, alignof(Node), sizeof(Node)) != 0) {
+      throw std::bad_alloc();
+    }
+    return new (memory) Node();
+  }
+
+  static void Delete(Node* node) {
+    node->~Node();
+    free(node);
+  }
+
+  static Node* Acquire() {
+    std::vector<Node*>& nodes = Local().nodes;
+    if (nodes.empty() && !TakeShared(nodes)) {
+      return New();
+    }
+    Node* node = nodes.back();
+    nodes.pop_back();
+    return node;
+  }
+
+  static void Release(Node* node) {
+    Local().nodes.push_back(node);
+  }
+
+ private:
+  struct Shared {
+    std::mutex lock;
+    std::vector<Node*> nodes;
+  };
+
+  struct Pool {
+    std::vector<Node*> nodes;
+
+    ~Pool() {
+      Shared& shared = GetShared();
+      std::lock_guard<std::mutex> guard(shared.lock);
+      shared.nodes.insert(shared.nodes.end(), nodes.begin(), nodes.end());
+    }
+  };
+
+  static Pool& Local() {
+    static thread_local Pool pool;
+    return pool;
+  }
+
+  // never destroyed, pools of threads exiting after main still use it.
+  static Shared& GetShared() {
+    static Shared* shared = new Shared();
+    return *shared;
+  }
+
+  static bool TakeShared(std::vector<Node*>& nodes) {
+    Shared& shared = GetShared();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    if (shared.nodes.empty()) {
+      return false;
+    }
+    nodes.swap(shared.nodes);
+    return true;
+  }
+};
+
+/*
+ * MCSLock queues waiters in a linked list, each spinning on its own node
+ * until its predecessor hands the lock over, so the lock's cache line is
+ * written once per acquisition and the lock is granted in FIFO order.
+ */
+class MCSLock {
+ private:
+  struct alignas(64) Node {
+    std::atomic<Node*> next;
+    std::atomic<bool> locked;
+
+    Node(): next(nullptr), locked(false) {}
+  };
+  typedef QueueNodePool<Node> NodePool;
+
+  std::atomic<Node*> tail_;
+  // node of the thread holding the lock, only used by that thread.
+  Node* holder_;
+
+ public:
+  MCSLock(): tail_(nullptr), holder_(nullptr) {}
+
+  inline void lock() {
+    Node* node = NodePool::Acquire();
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->locked.store(true, std::memory_order_relaxed);
+
+    Node* pred = tail_.exchange(node, std::memory_order_acq_rel);
+    if (pred != nullptr) {
+      pred->next.store(node, std::memory_order_release);
+      Backoff backoff;
+      while (node->locked.load(std::memory_order_acquire)) {
+        backoff.Pause();
+      }
+    }
+    holder_ = node;
+  }
+
+  inline void unlock() {
+    Node* node = holder_;
+    Node* next = node->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      Node* expected = node;
+      if (tail_.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+        NodePool::Release(node);
+        return;
+      }
+
+      // a waiter has swapped tail but not linked itself yet.
+      while ((next = node->next.load(std::memory_order_acquire)) == nullptr) {
+        CpuRelax();
+      }
+    }
+
+    next->locked.store(false, std::memory_order_release);
+    NodePool::Release(node);
+  }
+
+  inline bool try_lock() {
+    Node* node = NodePool::Acquire();
+    node->next.store(nullptr, std::memory_order_relaxed);
+    Node* expected = nullptr;
+    if (tail_.compare_exchange_strong(expected, node, std::memory_order_acq_rel)) {
+      holder_ = node;
+      return true;
+    }
+    NodePool::Release(node);
+    return false;
+  }
+};
+
+/*
+ * CLHLock queues waiters implicitly, each spinning on the node of its
+ * predecessor. The lock always owns the last released node, and a thread
+ * takes over its predecessor's node when it unlocks.
+ */
+class CLHLock {
+ private:
+  struct alignas(64) Node {
+    std::atomic<bool> locked;
+
+    Node(): locked(false) {}
+  };
+  typedef QueueNodePool<Node> NodePool;
+
+  std::atomic<Node*> tail_;
+  // nodes of the thread holding the lock, only used by that thread.
+  Node* holder_;
+  Node* pred_;
+
+ public:
+  CLHLock(): tail_(NodePool::New()), holder_(nullptr), pred_(nullptr) {}
+
+  ~CLHLock() {
+    NodePool::Delete(tail_.load());
+  }
+
+  CLHLock(const CLHLock&) = delete;
+  CLHLock& operator=(const CLHLock&) = delete;
+
+  inline void lock() {
+    Node* node = NodePool::Acquire();
+    node->locked.store(true, std::memory_order_relaxed);
+    Node* pred = tail_.exchange(node, std::memory_order_acq_rel);
+    Backoff backoff;
+    while (pred->locked.load(std::memory_order_acquire)) {
+      backoff.Pause();
+    }
+    holder_ = node;
+    pred_ = pred;
+  }
+
+  inline void unlock() {
+    Node* pred = pred_;
+    holder_->locked.store(false, std::memory_order_release);
+    NodePool::Release(pred);
+  }
+
+  inline bool try_lock() {
+    Node* pred = tail_.load(std::memory_order_acquire);
+    if (pred->locked.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    Node* node = NodePool::Acquire();
+    node->locked.store(true, std::memory_order_relaxed);
+    if (!tail_.compare_exchange_strong(pred, node, std::memory_order_acq_rel)) {
+      NodePool::Release(node);
+      return false;
+    }
+
+    // pred may have been recycled and enqueued again since it was checked,
+    // then this thread is queued behind it.
+    while (pred->locked.load(std::memory_order_acquire)) {
+      CpuRelax();
+    }
+    holder_ = node;
+    pred_ = pred;
+    return true;
+  }
+};
+
+/*
+ * FutexLock spins for a while, then parks the thread in the kernel until the
+ * holder wakes it. state_ is 0 when unlocked, 1 when locked and 2 when locked
+ * with possible sleepers, so an uncontended unlock makes no system call.
+ */
+class FutexLock {
+ private:
+  static const size_t SPIN_COUNT = 128;
+  std::atomic<int> state_;
+
+  inline void Wait(int value) {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<int*>(&state_), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+#else
+    (void)value;
+    std::this_thread::yield();
+#endif
+  }
+
+  inline void Wake() {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<int*>(&state_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+ public:
+  FutexLock(): state_(0) {}
+
+  inline void lock() {
+    for (size_t i = 0; i < SPIN_COUNT; i++) {
+      int expected = 0;
+      if (state_.compare_exchange_weak(expected, 1, std::memory_order_acquire)) {
+        return;
+      }
+      CpuRelax();
+    }
+
+    int state = state_.exchange(2, std::memory_order_acquire);
+    while (state != 0) {
+      Wait(2);
+      state = state_.exchange(2, std::memory_order_acquire);
+    }
+  }
+
+  inline void unlock() {
+    if (state_.exchange(0, std::memory_order_release) == 2) {
+      Wake();
+    }
+  }
+
+  inline bool try_lock() {
+    int expected = 0;
+    return state_.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+  }
+};
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_LOCKS_H
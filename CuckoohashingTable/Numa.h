@@ -0,0 +1,270 @@
+//
+// NUMA topology and placement of CuckoohashingTable memory on NUMA nodes.
+//
+
+#ifndef CONCURRENTLIB_NUMA_H
+#define CONCURRENTLIB_NUMA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Allocators.h"
+
+namespace concurrent_lib {
+
+/*
+ * NumaTopology maps cpus to NUMA nodes. System() reads the topology of this
+ * machine from sysfs. Node ids of a machine may have holes, GetNodeNum() is
+ * one past the highest online node and GetNodes() lists the online ones.
+ * A simulated topology splits cpus into nodeNum nodes of consecutive cpus, so
+ * node aware code can be tested on a single node machine. Memory is never
+ * bound to simulated nodes.
+ */
+class NumaTopology {
+ public:
+  NumaTopology(size_t nodeNum, size_t cpuNum)
+  : nodeNum_(nodeNum == 0 ? 1 : nodeNum), simulated_(true) {
+    for (size_t node = 0; node < nodeNum_; node++) {
+      nodes_.push_back(node);
+    }
+    cpuNodes_.resize(cpuNum == 0 ? 1 : cpuNum);
+    for (size_t cpu = 0; cpu < cpuNodes_.size(); cpu++) {
+      cpuNodes_[cpu] = cpu * nodeNum_ / cpuNodes_.size();
+    }
+  }
+
+  static const NumaTopology& System() {
+    static const NumaTopology topology = Read("/sys/devices/system/node");
+    return topology;
+  }
+
+  // Read the online list of a sysfs node directory, then node<i>/cpulist of
+  // every online node. A missing directory is one node.
+  static NumaTopology Read(const std::string& nodeDir) {
+    NumaTopology topology;
+    std::vector<size_t> nodes;
+    std::ifstream online(nodeDir + "/online");
+    std::string range;
+    while (online && std::getline(online, range, ',')) {
+      size_t first = 0, last = 0;
+      if (!ParseRange(range, first, last)) {
+        continue;
+      }
+      for (size_t node = first; node <= last; node++) {
+        nodes.push_back(node);
+      }
+    }
+    if (nodes.empty()) {
+      return topology;
+    }
+
+    topology.nodes_ = nodes;
+    topology.nodeNum_ = nodes.back() + 1;
+    topology.cpuNodes_.assign(1, nodes.front());
+    for (size_t node : nodes) {
+      std::ifstream cpuList(nodeDir + "/node" + std::to_string(node) + "/cpulist");
+      while (cpuList && std::getline(cpuList, range, ',')) {
+        size_t first = 0, last = 0;
+        if (!ParseRange(range, first, last)) {
+          continue;
+        }
+        if (topology.cpuNodes_.size() <= last) {
+          topology.cpuNodes_.resize(last + 1, nodes.front());
+        }
+        for (size_t cpu = first; cpu <= last; cpu++) {
+          topology.cpuNodes_[cpu] = node;
+        }
+      }
+    }
+    return topology;
+  }
+
+  inline size_t GetNodeNum() const {
+    return nodeNum_;
+  }
+
+  // online nodes in increasing order.
+  inline const std::vector<size_t>& GetNodes() const {
+    return nodes_;
+  }
+
+  inline bool IfNodeOnline(size_t node) const {
+    for (size_t online : nodes_) {
+      if (online == node) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  inline bool IfSimulated() const {
+    return simulated_;
+  }
+
+  inline size_t NodeOfCpu(size_t cpu) const {
+    return cpuNodes_[cpu % cpuNodes_.size()];
+  }
+
+  // Node of the cpu the calling thread runs on, it may move right after.
+  inline size_t CurrentNode() const {
+#if defined(__linux__)
+    const int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : NodeOfCpu(static_cast<size_t>(cpu));
+#else
+    return 0;
+#endif
+  }
+
+ private:
+  NumaTopology(): nodeNum_(1), simulated_(false), nodes_(1, 0), cpuNodes_(1, 0) {}
+
+  // "3" or "0-7".
+  static bool ParseRange(const std::string& range, size_t& first, size_t& last) {
+    try {
+      size_t end = 0;
+      first = std::stoul(range, &end);
+      last = first;
+      if (end < range.size() && range[end] == '-') {
+        last = std::stoul(range.substr(end + 1));
+      }
+      return first <= last;
+    } catch (...) {
+      return false;
+    }
+  }
+
+  size_t nodeNum_;
+  bool simulated_;
+  std::vector<size_t> nodes_;
+  std::vector<size_t> cpuNodes_;
+};
+
+/*
+ * NumaAllocator maps memory with mmap and sets its NUMA policy with mbind
+ * before any page is touched: pages interleaved over all nodes, so every
+ * node sees the same average latency, or all of them bound to one node.
+ * Placement is a hint, memory is used as is if mbind fails or the topology
+ * is simulated. Allocations of 2 MB or more are advised to use huge pages.
+ */
+template <typename T>
+class NumaAllocator {
+ public:
+  typedef T value_type;
+
+  static const size_t INTERLEAVE = ~size_t(0);
+
+  // Interleave over the nodes of topology.
+  explicit NumaAllocator(const NumaTopology& topology = NumaTopology::System())
+  : topology_(&topology), node_(INTERLEAVE) {}
+
+  // Bind to node of topology.
+  NumaAllocator(const NumaTopology& topology, size_t node)
+  : topology_(&topology), node_(node) {}
+
+  template <typename U>
+  NumaAllocator(const NumaAllocator<U>& other)
+  : topology_(other.GetTopology()), node_(other.GetNode()) {}
+
+  T* allocate(size_t n) {
+    const size_t bytes = RoundUp(n * sizeof(T));
+#if defined(__linux__)
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#if defined(MADV_HUGEPAGE)
+    if (bytes >= (size_t(2) << 20)) {
+      madvise(memory, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    Place(memory, bytes);
+    return static_cast<T*>(memory);
+#else
+    return CacheAlignedAllocator<T>().allocate(n);
+#endif
+  }
+
+  void deallocate(T* p, size_t n) {
+#if defined(__linux__)
+    munmap(p, RoundUp(n * sizeof(T)));
+#else
+    CacheAlignedAllocator<T>().deallocate(p, n);
+#endif
+  }
+
+  inline const NumaTopology* GetTopology() const {
+    return topology_;
+  }
+
+  // INTERLEAVE or the node memory is bound to.
+  inline size_t GetNode() const {
+    return node_;
+  }
+
+ private:
+  // mempolicy modes of linux/mempolicy.h.
+  static const int MPOL_BIND_MODE = 2;
+  static const int MPOL_INTERLEAVE_MODE = 3;
+  static const size_t WORD_BITS = sizeof(unsigned long) * 8;
+
+  static inline size_t RoundUp(size_t bytes) {
+    const size_t page = 4096;
+    return bytes == 0 ? page : (bytes + page - 1) & ~(page - 1);
+  }
+
+  void Place(void* memory, size_t bytes) const {
+#if defined(__linux__) && defined(SYS_mbind)
+    const size_t nodeNum = topology_->GetNodeNum();
+    if (topology_->IfSimulated() || (node_ == INTERLEAVE && topology_->GetNodes().size() == 1) ||
+        (node_ != INTERLEAVE && !topology_->IfNodeOnline(node_))) {
+      return;
+    }
+
+    // offline nodes have no memory to place pages on.
+    std::vector<unsigned long> nodeMask((nodeNum + WORD_BITS - 1) / WORD_BITS, 0);
+    for (size_t node : topology_->GetNodes()) {
+      if (node_ == INTERLEAVE || node == node_) {
+        nodeMask[node / WORD_BITS] |= 1ul << (node % WORD_BITS);
+      }
+    }
+    // the kernel reads maxnode - 1 bits.
+    syscall(SYS_mbind, memory, bytes, node_ == INTERLEAVE ? MPOL_INTERLEAVE_MODE : MPOL_BIND_MODE,
+            nodeMask.data(), nodeMask.size() * WORD_BITS + 1, 0);
+#else
+    (void)memory;
+    (void)bytes;
+#endif
+  }
+
+  const NumaTopology* topology_;
+  size_t node_;
+};
+
+template <typename T>
+const size_t NumaAllocator<T>::INTERLEAVE;
+
+template <typename T, typename U>
+inline bool operator==(const NumaAllocator<T>& first, const NumaAllocator<U>& second) {
+  return first.GetTopology() == second.GetTopology() && first.GetNode() == second.GetNode();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const NumaAllocator<T>& first, const NumaAllocator<U>& second) {
+  return !(first == second);
+}
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_NUMA_H
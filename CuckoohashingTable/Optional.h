@@ -0,0 +1,118 @@
+//
+// Optional holds either a value or nothing, it stands in for std::optional
+// which is not available in C++11.
+//
+
+#ifndef CONCURRENTLIB_OPTIONAL_H
+#define CONCURRENTLIB_OPTIONAL_H
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace concurrent_lib {
+
+template <typename T>
+class Optional {
+ public:
+  Optional(): hasValue_(false) {}
+
+  Optional(const T& value): hasValue_(false) {
+    Emplace(value);
+  }
+
+  Optional(T&& value): hasValue_(false) {
+    Emplace(std::move(value));
+  }
+
+  Optional(const Optional& other): hasValue_(false) {
+    if (other.hasValue_) {
+      Emplace(*other);
+    }
+  }
+
+  Optional(Optional&& other): hasValue_(false) {
+    if (other.hasValue_) {
+      Emplace(std::move(*other));
+    }
+  }
+
+  ~Optional() {
+    Reset();
+  }
+
+  Optional& operator=(Optional other) {
+    Reset();
+    if (other.hasValue_) {
+      Emplace(std::move(*other));
+    }
+    return *this;
+  }
+
+  template <typename... Args>
+  void Emplace(Args&&... args) {
+    Reset();
+    new (&storage_) T(std::forward<Args>(args)...);
+    hasValue_ = true;
+  }
+
+  void Reset() {
+    if (hasValue_) {
+      Get().~T();
+      hasValue_ = false;
+    }
+  }
+
+  inline bool HasValue() const {
+    return hasValue_;
+  }
+
+  explicit operator bool() const {
+    return hasValue_;
+  }
+
+  // Following accessors must only be called when HasValue() is true.
+  T& Value() {
+    return Get();
+  }
+
+  const T& Value() const {
+    return Get();
+  }
+
+  T& operator*() {
+    return Get();
+  }
+
+  const T& operator*() const {
+    return Get();
+  }
+
+  T* operator->() {
+    return &Get();
+  }
+
+  const T* operator->() const {
+    return &Get();
+  }
+
+  T ValueOr(const T& defaultValue) const {
+    return hasValue_ ? Get() : defaultValue;
+  }
+
+ private:
+  inline T& Get() {
+    return *static_cast<T*>(static_cast<void*>(&storage_));
+  }
+
+  inline const T& Get() const {
+    return *static_cast<const T*>(static_cast<const void*>(&storage_));
+  }
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+  bool hasValue_;
+};
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_OPTIONAL_H
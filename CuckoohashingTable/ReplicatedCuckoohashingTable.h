@@ -0,0 +1,143 @@
+//
+// Read-mostly CuckoohashingTable with one replica per NUMA node.
+//
+
+#ifndef CONCURRENTLIB_REPLICATEDCUCKOOHASHINGTABLE_H
+#define CONCURRENTLIB_REPLICATEDCUCKOOHASHINGTABLE_H
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "CuckoohashingTable.h"
+#include "Numa.h"
+
+namespace concurrent_lib {
+
+/*
+ * ReplicatedCuckoohashingTable keeps a full copy of the table on every NUMA
+ * node, with its buckets and lock stripes bound to that node, and reads from
+ * the replica of the node the calling thread runs on, so lookups never touch
+ * remote memory. Writes go to every replica one after another, serialized by
+ * one mutex, so they cost a write per node and do not scale: use it for
+ * tables that are mostly read. Readers on different nodes may briefly
+ * disagree about a key a write is applying, each replica alone behaves like
+ * a CuckoohashingTable. Keys and values are copied into every replica.
+ * Only online nodes get a replica. topology must outlive the table.
+ */
+template <typename KeyType,
+          typename ValueType,
+          class KeyHahser = std::hash<KeyType>,
+          class KeyEqualChekcer = std::equal_to<KeyType>,
+          size_t SLOT_PER_BUCKET = 4>
+class ReplicatedCuckoohashingTable {
+ public:
+  typedef CuckoohashingTable<KeyType, ValueType, KeyHahser, KeyEqualChekcer, SLOT_PER_BUCKET,
+                             BackoffSpinlock, uint8_t, false, NumaAllocator<char>> Replica;
+
+  explicit ReplicatedCuckoohashingTable(size_t initialCapacity = 512 * SLOT_PER_BUCKET,
+                                        const NumaTopology& topology = NumaTopology::System())
+  : topology_(topology), replicaOfNode_(topology.GetNodeNum(), 0) {
+    for (size_t node : topology_.GetNodes()) {
+      replicaOfNode_[node] = replicas_.size();
+      replicas_.push_back(NewReplica(initialCapacity, node));
+    }
+  }
+
+  bool Lookup(const KeyType& key) {
+    return LocalReplica().Lookup(key);
+  }
+
+  bool Find(const KeyType& key, ValueType& value) {
+    return LocalReplica().Find(key, value);
+  }
+
+  Optional<ValueType> Find(const KeyType& key) {
+    return LocalReplica().Find(key);
+  }
+
+  ValueType FindOrDefault(const KeyType& key, const ValueType& defaultValue) {
+    return LocalReplica().FindOrDefault(key, defaultValue);
+  }
+
+  // return true if key is inserted, false if it is in the table already.
+  bool Insert(KeyType&& key, ValueType&& value) {
+    std::lock_guard<std::mutex> writeGuard(writeLock_);
+    for (size_t i = 0; i + 1 < replicas_.size(); i++) {
+      KeyType keyCopy(key);
+      ValueType valueCopy(value);
+      replicas_[i]->Insert(std::move(keyCopy), std::move(valueCopy));
+    }
+    return replicas_.back()->Insert(std::forward<KeyType>(key), std::forward<ValueType>(value));
+  }
+
+  // Replace the value of key, return false if key is not found.
+  bool Update(const KeyType& key, ValueType&& value) {
+    std::lock_guard<std::mutex> writeGuard(writeLock_);
+    for (size_t i = 0; i + 1 < replicas_.size(); i++) {
+      ValueType valueCopy(value);
+      replicas_[i]->Update(key, std::move(valueCopy));
+    }
+    return replicas_.back()->Update(key, std::forward<ValueType>(value));
+  }
+
+  // return true if key is found and erased.
+  bool Erase(const KeyType& key) {
+    std::lock_guard<std::mutex> writeGuard(writeLock_);
+    bool erased = false;
+    for (auto& replica : replicas_) {
+      erased = replica->Erase(key);
+    }
+    return erased;
+  }
+
+  inline size_t GetReplicaNum() const {
+    return replicas_.size();
+  }
+
+  // Replica of an online node, it must not be written to directly.
+  Replica& GetReplica(size_t node) {
+    return *replicas_[replicaOfNode_[node]];
+  }
+
+  Replica& LocalReplica() {
+    return GetReplica(topology_.CurrentNode());
+  }
+
+ private:
+  // The replica object itself, with its reader slots and lock table pointer
+  // written or read by every operation, lives on its node too. Pages also
+  // meet its cache line alignment, which plain new does not before C++17.
+  struct ReplicaDeleter {
+    NumaAllocator<Replica> allocator;
+
+    void operator()(Replica* replica) {
+      replica->~Replica();
+      allocator.deallocate(replica, 1);
+    }
+  };
+  typedef std::unique_ptr<Replica, ReplicaDeleter> ReplicaPtr;
+
+  ReplicaPtr NewReplica(size_t initialCapacity, size_t node) {
+    NumaAllocator<Replica> allocator(topology_, node);
+    Replica* memory = allocator.allocate(1);
+    try {
+      return ReplicaPtr(new (memory) Replica(Replica::EAGER, initialCapacity, Replica::DEFAULT_MAX_STEP,
+                                             NumaAllocator<char>(topology_, node)),
+                        ReplicaDeleter{allocator});
+    } catch (...) {
+      allocator.deallocate(memory, 1);
+      throw;
+    }
+  }
+
+  const NumaTopology& topology_;
+  std::vector<size_t> replicaOfNode_;
+  std::vector<ReplicaPtr> replicas_;
+  std::mutex writeLock_;
+};
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_REPLICATEDCUCKOOHASHINGTABLE_H
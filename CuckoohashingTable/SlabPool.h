@@ -0,0 +1,125 @@
+//
+// Fixed size object pool for the values CuckoohashingTable stores out of line.
+//
+
+#ifndef CONCURRENTLIB_SLABPOOL_H
+#define CONCURRENTLIB_SLABPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "Locks.h"
+
+namespace concurrent_lib {
+
+/*
+ * SlabPool<T> hands out memory for objects of type T, carved out of slabs of
+ * many objects. The pool is split into shards, each with its own free list,
+ * current slab and lock. A thread always uses the same shard, so threads
+ * rarely contend on the pool and freed memory is reused by the thread that
+ * freed it. Slabs are returned to the system only when the pool is destroyed,
+ * objects still allocated are not destroyed by the pool.
+ */
+template <typename T>
+class SlabPool {
+ private:
+  static const size_t SHARD_NUM = 16;
+  static const size_t SLAB_BYTES = 256 * 1024;
+
+  union Block {
+    Block* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  static const size_t BLOCKS_PER_SLAB = SLAB_BYTES / sizeof(Block) > 0 ? SLAB_BYTES / sizeof(Block) : 1;
+  static const size_t SLAB_ALIGN = alignof(Block) > 64 ? alignof(Block) : 64;
+
+  struct alignas(64) Shard {
+    BackoffSpinlock lock;
+    Block* freeList;
+    // unused part of the current slab.
+    Block* next;
+    Block* end;
+    std::vector<void*> slabs;
+
+    Shard(): freeList(nullptr), next(nullptr), end(nullptr) {}
+  };
+
+  Shard shards_[SHARD_NUM];
+
+  static inline size_t LocalShard() {
+    static std::atomic<size_t> nextShard(0);
+    static thread_local size_t shard = nextShard.fetch_add(1) % SHARD_NUM;
+    return shard;
+  }
+
+  static void NewSlab(Shard& shard) {
+    shard.slabs.push_back(nullptr);
+    void* memory = nullptr;
+    if (posix_memalign(&memory, SLAB_ALIGN, sizeof(Block) * BLOCKS_PER_SLAB) != 0) {
+      shard.slabs.pop_back();
+      throw std::bad_alloc();
+    }
+    shard.slabs.back() = memory;
+    shard.next = static_cast<Block*>(memory);
+    shard.end = shard.next + BLOCKS_PER_SLAB;
+  }
+
+ public:
+  SlabPool() {}
+
+  ~SlabPool() {
+    for (size_t i = 0; i < SHARD_NUM; i++) {
+      for (void* slab : shards_[i].slabs) {
+        free(slab);
+      }
+    }
+  }
+
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator=(const SlabPool&) = delete;
+
+  // return uninitialized memory for one T.
+  void* Allocate() {
+    Shard& shard = shards_[LocalShard()];
+    std::lock_guard<BackoffSpinlock> guard(shard.lock);
+    if (shard.freeList != nullptr) {
+      Block* block = shard.freeList;
+      shard.freeList = block->next;
+      return block;
+    }
+
+    if (shard.next == shard.end) {
+      NewSlab(shard);
+    }
+    return shard.next++;
+  }
+
+  // Memory of all slabs, free blocks included.
+  size_t GetBytes() {
+    size_t slabNum = 0;
+    for (size_t i = 0; i < SHARD_NUM; i++) {
+      std::lock_guard<BackoffSpinlock> guard(shards_[i].lock);
+      slabNum += shards_[i].slabs.size();
+    }
+    return slabNum * sizeof(Block) * BLOCKS_PER_SLAB;
+  }
+
+  // Give back memory from Allocate, the object in it must be destroyed already.
+  void Free(void* object) {
+    Block* block = static_cast<Block*>(object);
+    Shard& shard = shards_[LocalShard()];
+    std::lock_guard<BackoffSpinlock> guard(shard.lock);
+    block->next = shard.freeList;
+    shard.freeList = block;
+  }
+};
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_SLABPOOL_H
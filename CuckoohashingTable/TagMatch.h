@@ -0,0 +1,145 @@
+//
+// Compare the partial keys (tags) of a bucket against the tag of a key with
+// SIMD compares, so full keys are only compared on tag hits.
+//
+
+#ifndef CONCURRENTLIB_TAGMATCH_H
+#define CONCURRENTLIB_TAGMATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace concurrent_lib {
+
+/*
+ * TagMatch<N, TagType> matches buckets of N tags of 8 or 16 bits. The result
+ * is a bitmask where bit i is set if tags[i] equals tag. For a pair of buckets
+ * bits [0, N) belong to the first bucket and bits [N, 2N) to the second one.
+ */
+template <size_t N, typename TagType = uint8_t>
+struct TagMatch {
+  static inline uint32_t Match(const TagType* tags, TagType tag) {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < N; i++) {
+      mask |= static_cast<uint32_t>(tags[i] == tag) << i;
+    }
+    return mask;
+  }
+
+  static inline uint32_t MatchPair(const TagType* first, const TagType* second, TagType tag) {
+    return Match(first, tag) | (Match(second, tag) << N);
+  }
+};
+
+#if defined(__SSE2__)
+// Both buckets of 4 tags fit in the low 8 bytes of one register.
+template <>
+struct TagMatch<4, uint8_t> {
+  static inline uint32_t Match(const uint8_t* tags, uint8_t tag) {
+    return MatchPair(tags, tags, tag) & 0xf;
+  }
+
+  static inline uint32_t MatchPair(const uint8_t* first, const uint8_t* second, uint8_t tag) {
+    uint32_t firstTags, secondTags;
+    std::memcpy(&firstTags, first, sizeof(firstTags));
+    std::memcpy(&secondTags, second, sizeof(secondTags));
+    __m128i tags = _mm_unpacklo_epi32(_mm_cvtsi32_si128(firstTags),
+                                      _mm_cvtsi32_si128(secondTags));
+    __m128i hits = _mm_cmpeq_epi8(tags, _mm_set1_epi8(static_cast<char>(tag)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(hits)) & 0xff;
+  }
+};
+
+template <>
+struct TagMatch<8, uint8_t> {
+  static inline uint32_t Match(const uint8_t* tags, uint8_t tag) {
+    return MatchPair(tags, tags, tag) & 0xff;
+  }
+
+  static inline uint32_t MatchPair(const uint8_t* first, const uint8_t* second, uint8_t tag) {
+    __m128i tags = _mm_unpacklo_epi64(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(first)),
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(second)));
+    __m128i hits = _mm_cmpeq_epi8(tags, _mm_set1_epi8(static_cast<char>(tag)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(hits));
+  }
+};
+
+template <>
+struct TagMatch<16, uint8_t> {
+  static inline uint32_t Match(const uint8_t* tags, uint8_t tag) {
+    __m128i hits = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tags)),
+                                  _mm_set1_epi8(static_cast<char>(tag)));
+    return static_cast<uint32_t>(_mm_movemask_epi8(hits));
+  }
+
+  static inline uint32_t MatchPair(const uint8_t* first, const uint8_t* second, uint8_t tag) {
+#if defined(__AVX2__)
+    __m256i tags = _mm256_set_m128i(_mm_loadu_si128(reinterpret_cast<const __m128i*>(second)),
+                                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(first)));
+    __m256i hits = _mm256_cmpeq_epi8(tags, _mm256_set1_epi8(static_cast<char>(tag)));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(hits));
+#else
+    return Match(first, tag) | (Match(second, tag) << 16);
+#endif
+  }
+};
+
+// 16-bit tags are compared as words, then the word masks are packed to bytes
+// so that movemask gives one bit per tag.
+static inline uint32_t MatchWords(__m128i low, __m128i high, uint16_t tag) {
+  const __m128i tags = _mm_set1_epi16(static_cast<short>(tag));
+  return static_cast<uint32_t>(_mm_movemask_epi8(
+      _mm_packs_epi16(_mm_cmpeq_epi16(low, tags), _mm_cmpeq_epi16(high, tags))));
+}
+
+template <>
+struct TagMatch<4, uint16_t> {
+  static inline uint32_t Match(const uint16_t* tags, uint16_t tag) {
+    return MatchPair(tags, tags, tag) & 0xf;
+  }
+
+  static inline uint32_t MatchPair(const uint16_t* first, const uint16_t* second, uint16_t tag) {
+    __m128i tags = _mm_unpacklo_epi64(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(first)),
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(second)));
+    return MatchWords(tags, _mm_setzero_si128(), tag) & 0xff;
+  }
+};
+
+template <>
+struct TagMatch<8, uint16_t> {
+  static inline uint32_t Match(const uint16_t* tags, uint16_t tag) {
+    return MatchPair(tags, tags, tag) & 0xff;
+  }
+
+  static inline uint32_t MatchPair(const uint16_t* first, const uint16_t* second, uint16_t tag) {
+    return MatchWords(_mm_loadu_si128(reinterpret_cast<const __m128i*>(first)),
+                      _mm_loadu_si128(reinterpret_cast<const __m128i*>(second)), tag);
+  }
+};
+
+template <>
+struct TagMatch<16, uint16_t> {
+  static inline uint32_t Match(const uint16_t* tags, uint16_t tag) {
+    return MatchWords(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tags)),
+                      _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + 8)), tag);
+  }
+
+  static inline uint32_t MatchPair(const uint16_t* first, const uint16_t* second, uint16_t tag) {
+    return Match(first, tag) | (Match(second, tag) << 16);
+  }
+};
+#endif  // __SSE2__
+
+}  // namespace concurrent_lib
+
+#endif //CONCURRENTLIB_TAGMATCH_H
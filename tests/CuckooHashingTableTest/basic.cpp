@@ -2,15 +2,1012 @@
 // Created by rui_wang on 9/8/16.
 //
 
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 #include "CuckoohashingTable.h"
+#include "ReplicatedCuckoohashingTable.h"
 
 class CuckooHasingTableBasicTest : public ::testing::Test { };
 
+// std::hash<int> is identity, which puts every key in the same pair of
+// buckets. Spread keys over the whole table to exercise cuckoo moves.
+struct MixHasher {
+  size_t operator()(int key) const {
+    return static_cast<size_t>(key) * 0x9E3779B97F4A7C15ULL;
+  }
+};
+
 TEST_F(CuckooHasingTableBasicTest, BasicTest) {
   concurrent_lib::CuckoohashingTable<int, int> table;
   //table.Insert(std::move(3), std::move(3));
-  std::cout << table.Size() << std::endl;
-}
\ No newline at end of file
+  std::cout << table.BucketCount() << std::endl;
+}
+
+TEST_F(CuckooHasingTableBasicTest, InsertAndLookup) {
+  concurrent_lib::CuckoohashingTable<int, int> table;
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(table.Insert(std::move(i), i * 2));
+  }
+
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(table.Lookup(i));
+  }
+  EXPECT_FALSE(table.Lookup(100));
+
+  // duplicate keys are rejected.
+  EXPECT_FALSE(table.Insert(3, 3));
+}
+
+TEST_F(CuckooHasingTableBasicTest, InsertToHighLoadFactor) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher> table;
+  const int count = static_cast<int>(table.BucketCount() * decltype(table)::BUCKET_SIZE * 0.9);
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_TRUE(table.Lookup(i));
+  }
+  EXPECT_FALSE(table.Lookup(count));
+}
+
+TEST_F(CuckooHasingTableBasicTest, InsertBeyondCapacity) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher> table;
+  const size_t initSize = table.BucketCount();
+  const int count = static_cast<int>(initSize * decltype(table)::BUCKET_SIZE * 10);
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  EXPECT_GE(table.BucketCount(), initSize * 8);
+  for (int i = 0; i < count; i++) {
+    EXPECT_TRUE(table.Lookup(i));
+  }
+  EXPECT_FALSE(table.Lookup(count));
+}
+
+TEST_F(CuckooHasingTableBasicTest, InsertBeyondCapacityIncremental) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher> Table;
+  Table table(Table::INCREMENTAL);
+  const int count = static_cast<int>(table.BucketCount() * decltype(table)::BUCKET_SIZE * 10);
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+    // keys in buckets not migrated yet are still visible.
+    ASSERT_TRUE(table.Lookup(i / 2));
+  }
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_TRUE(table.Lookup(i));
+  }
+  EXPECT_FALSE(table.Lookup(count));
+}
+
+// Once every old bucket is migrated the old array is freed, operations do
+// not keep paying for it.
+TEST_F(CuckooHasingTableBasicTest, IncrementalMigrationFreesOldBuckets) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher> Table;
+  Table table(Table::INCREMENTAL, 64);
+  const Table::TableStats initStats = table.Stats();
+  const size_t bucketBytes = initStats.bucketBytes / initStats.bucketNum;
+
+  const int count = 100000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Lookup(i));
+  }
+  const Table::TableStats stats = table.Stats();
+  EXPECT_EQ(bucketBytes * stats.bucketNum, stats.bucketBytes);
+}
+
+TEST_F(CuckooHasingTableBasicTest, Find) {
+  concurrent_lib::CuckoohashingTable<int, std::string> table;
+  EXPECT_TRUE(table.Insert(1, "one"));
+  EXPECT_TRUE(table.Insert(2, "two"));
+
+  std::string value;
+  EXPECT_TRUE(table.Find(1, value));
+  EXPECT_EQ("one", value);
+  EXPECT_FALSE(table.Find(3, value));
+  EXPECT_EQ("one", value);
+
+  concurrent_lib::Optional<std::string> found = table.Find(2);
+  ASSERT_TRUE(found.HasValue());
+  EXPECT_EQ("two", *found);
+  EXPECT_FALSE(table.Find(3).HasValue());
+
+  EXPECT_EQ("two", table.FindOrDefault(2, "none"));
+  EXPECT_EQ("none", table.FindOrDefault(3, "none"));
+
+  size_t length = 0;
+  EXPECT_TRUE(table.FindFn(1, [&length](const std::string& v) {
+    length = v.size();
+  }));
+  EXPECT_EQ(3u, length);
+  EXPECT_FALSE(table.FindFn(3, [](const std::string&) {}));
+}
+
+TEST_F(CuckooHasingTableBasicTest, Erase) {
+  concurrent_lib::CuckoohashingTable<int, std::string, MixHasher> table;
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::to_string(i)));
+  }
+
+  EXPECT_TRUE(table.Erase(1));
+  EXPECT_FALSE(table.Lookup(1));
+  EXPECT_FALSE(table.Erase(1));
+
+  EXPECT_FALSE(table.EraseFn(2, [](const std::string& v) { return v == "3"; }));
+  EXPECT_TRUE(table.Lookup(2));
+  EXPECT_TRUE(table.EraseFn(2, [](const std::string& v) { return v == "2"; }));
+  EXPECT_FALSE(table.Lookup(2));
+
+  // erased slots are reused.
+  EXPECT_TRUE(table.Insert(1, "one"));
+  EXPECT_EQ("one", table.FindOrDefault(1, ""));
+}
+
+TEST_F(CuckooHasingTableBasicTest, EraseKeepsTableSize) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher> table;
+  const size_t size = table.BucketCount();
+  const int count = static_cast<int>(size * decltype(table)::BUCKET_SIZE * 0.8);
+  for (int round = 0; round < 10; round++) {
+    for (int i = 0; i < count; i++) {
+      int key = round * count + i;
+      ASSERT_TRUE(table.Insert(std::move(key), std::move(i)));
+    }
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(table.Erase(round * count + i));
+    }
+  }
+  EXPECT_EQ(size, table.BucketCount());
+}
+
+TEST_F(CuckooHasingTableBasicTest, UpdateAndUpsert) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher> table;
+  EXPECT_FALSE(table.Update(1, 10));
+  EXPECT_TRUE(table.Insert(1, 1));
+  EXPECT_TRUE(table.Update(1, 10));
+  EXPECT_EQ(10, table.FindOrDefault(1, 0));
+
+  EXPECT_TRUE(table.UpdateFn(1, [](int& v) { v *= 2; }));
+  EXPECT_EQ(20, table.FindOrDefault(1, 0));
+  EXPECT_FALSE(table.UpdateFn(2, [](int& v) { v *= 2; }));
+
+  EXPECT_TRUE(table.Upsert(2, [](int& v) { v++; }, 1));
+  EXPECT_FALSE(table.Upsert(2, [](int& v) { v++; }, 1));
+  EXPECT_EQ(2, table.FindOrDefault(2, 0));
+}
+
+// SIMD matching must agree with a plain loop for every bucket size and tag width.
+template <size_t N, typename TagType>
+void CheckTagMatch() {
+  TagType first[16], second[16];
+  for (int round = 0; round < 100; round++) {
+    for (int i = 0; i < 16; i++) {
+      first[i] = static_cast<TagType>((round * 7 + i * 13) % 5);
+      second[i] = static_cast<TagType>((round * 11 + i * 3) % 5 + 250);
+    }
+    for (int tag = 0; tag < 300; tag++) {
+      uint32_t expected = 0;
+      for (size_t i = 0; i < N; i++) {
+        expected |= static_cast<uint32_t>(first[i] == static_cast<TagType>(tag)) << i;
+        expected |= static_cast<uint32_t>(second[i] == static_cast<TagType>(tag)) << (i + N);
+      }
+      ASSERT_EQ(expected, (concurrent_lib::TagMatch<N, TagType>::MatchPair(
+          first, second, static_cast<TagType>(tag))));
+      ASSERT_EQ(expected & ((1u << N) - 1), (concurrent_lib::TagMatch<N, TagType>::Match(
+          first, static_cast<TagType>(tag))));
+    }
+  }
+}
+
+TEST_F(CuckooHasingTableBasicTest, TagMatch) {
+  CheckTagMatch<3, uint8_t>();
+  CheckTagMatch<4, uint8_t>();
+  CheckTagMatch<8, uint8_t>();
+  CheckTagMatch<16, uint8_t>();
+  CheckTagMatch<3, uint16_t>();
+  CheckTagMatch<4, uint16_t>();
+  CheckTagMatch<8, uint16_t>();
+  CheckTagMatch<16, uint16_t>();
+}
+
+// Keys are only compared after their tags match.
+struct CountingEqual {
+  static size_t calls;
+  bool operator()(int a, int b) const {
+    calls++;
+    return a == b;
+  }
+};
+size_t CountingEqual::calls = 0;
+
+TEST_F(CuckooHasingTableBasicTest, LookupComparesOnlyTagHits) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher, CountingEqual> table;
+  const int count = 1000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  CountingEqual::calls = 0;
+  for (int i = count; i < 2 * count; i++) {
+    EXPECT_FALSE(table.Lookup(i));
+  }
+  // at most 8 slots with a 1 in 256 chance of a tag collision each.
+  EXPECT_LT(CountingEqual::calls, static_cast<size_t>(count / 4));
+}
+
+TEST_F(CuckooHasingTableBasicTest, SixteenBitTags) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher, CountingEqual, 4,
+                                     concurrent_lib::BackoffSpinlock, uint16_t> table;
+  const int count = 20000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  CountingEqual::calls = 0;
+  for (int i = count; i < 2 * count; i++) {
+    EXPECT_FALSE(table.Lookup(i));
+  }
+  // 1 in 65536 chance of a tag collision per slot.
+  EXPECT_LT(CountingEqual::calls, static_cast<size_t>(count / 1000));
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(i, table.FindOrDefault(i, -1));
+  }
+}
+
+template <size_t SLOT_PER_BUCKET>
+void InsertWithGeometry(size_t initialCapacity, size_t maxStep) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, SLOT_PER_BUCKET> Table;
+  Table table(Table::EAGER, initialCapacity, maxStep);
+  const size_t initSize = table.BucketCount();
+  EXPECT_GE(initSize * SLOT_PER_BUCKET, initialCapacity);
+
+  const int count = static_cast<int>(initialCapacity * 3);
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(i, table.FindOrDefault(i, -1));
+  }
+  EXPECT_FALSE(table.Lookup(count));
+  EXPECT_GT(table.BucketCount(), initSize);
+}
+
+TEST_F(CuckooHasingTableBasicTest, BucketGeometry) {
+  InsertWithGeometry<1>(1000, 8);
+  InsertWithGeometry<2>(5000, 0);
+  InsertWithGeometry<8>(10000, 3);
+  InsertWithGeometry<16>(20000, 16);
+}
+
+// A table of two buckets holds every key in either bucket, so it is only
+// full when every slot is taken, including the highest ones.
+template <size_t SLOT_PER_BUCKET>
+void FillTwoBuckets() {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, SLOT_PER_BUCKET> Table;
+  Table table(Table::EAGER, 2 * SLOT_PER_BUCKET);
+  ASSERT_EQ(2u, table.BucketCount());
+
+  const int count = static_cast<int>(2 * SLOT_PER_BUCKET);
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+  EXPECT_EQ(2u, table.BucketCount());
+
+  // free slots in the middle of buckets are found again.
+  for (int i = 0; i < count; i += 3) {
+    ASSERT_TRUE(table.Erase(i));
+  }
+  for (int i = 0; i < count; i += 3) {
+    int key = count + i;
+    ASSERT_TRUE(table.Insert(std::move(key), std::move(i)));
+  }
+  EXPECT_EQ(2u, table.BucketCount());
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(i, table.FindOrDefault(i % 3 == 0 ? count + i : i, -1));
+  }
+
+  int key = 2 * count;
+  ASSERT_TRUE(table.Insert(std::move(key), 0));
+  EXPECT_GT(table.BucketCount(), 2u);
+}
+
+TEST_F(CuckooHasingTableBasicTest, FreeSlotSearch) {
+  FillTwoBuckets<1>();
+  FillTwoBuckets<4>();
+  FillTwoBuckets<8>();
+  FillTwoBuckets<16>();
+}
+
+TEST_F(CuckooHasingTableBasicTest, LockedTable) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher> Table;
+  Table table(Table::INCREMENTAL, 64);
+  const int count = 3000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  {
+    Table::LockedTable locked = table.LockAll();
+    EXPECT_TRUE(locked.IfLocked());
+    EXPECT_EQ(static_cast<size_t>(count), locked.Size());
+
+    std::vector<bool> seen(count, false);
+    for (auto cell : locked) {
+      ASSERT_EQ(cell.first, cell.second);
+      EXPECT_FALSE(seen[cell.first]);
+      seen[cell.first] = true;
+      cell.second *= 2;
+    }
+    EXPECT_EQ(std::vector<bool>(count, true), seen);
+
+    // erase odd keys while scanning.
+    for (auto it = locked.begin(); it != locked.end();) {
+      it = it->first % 2 == 1 ? locked.Erase(it) : std::next(it);
+    }
+    EXPECT_EQ(static_cast<size_t>(count / 2), locked.Size());
+  }
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(i % 2 == 0 ? i * 2 : -1, table.FindOrDefault(i, -1));
+  }
+
+  // only values can be written through iterators, a changed key would be in
+  // the wrong bucket.
+  typedef Table::LockedTable::iterator::reference Reference;
+  static_assert(!std::is_assignable<decltype(std::declval<Reference>().first), int>::value,
+                "keys of a locked table are const");
+  static_assert(std::is_assignable<decltype(std::declval<Reference>().second), int>::value,
+                "values of a locked table are writable");
+  static_assert(std::is_same<std::pair<const int, int>, Table::LockedTable::value_type>::value,
+                "value_type has a const key");
+
+  const size_t tableSize = table.BucketCount();
+  Table::LockedTable locked = table.LockAll();
+  locked.Clear();
+  EXPECT_EQ(0u, locked.Size());
+  EXPECT_TRUE(locked.begin() == locked.end());
+  locked.Unlock();
+  EXPECT_FALSE(locked.IfLocked());
+
+  EXPECT_FALSE(table.Lookup(0));
+  EXPECT_EQ(tableSize, table.BucketCount());
+  int key = 1;
+  EXPECT_TRUE(table.Insert(std::move(key), 1));
+}
+
+TEST_F(CuckooHasingTableBasicTest, ParallelForEach) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher> Table;
+  Table table(Table::INCREMENTAL, 64);
+  const int count = 20000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  for (size_t threadNum : {1, 4}) {
+    std::vector<std::atomic<int>> visits(count);
+    table.ParallelForEach([&visits](const int& key, int& value) {
+      visits[key]++;
+      value++;
+    }, threadNum);
+    for (int i = 0; i < count; i++) {
+      ASSERT_EQ(1, visits[i].load());
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(i + 2, table.FindOrDefault(i, -1));
+  }
+}
+
+TEST_F(CuckooHasingTableBasicTest, Batch) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher> table;
+  const int count = 5000;
+  std::vector<int> keys(count), values(count);
+  for (int i = 0; i < count; i++) {
+    keys[i] = i;
+    values[i] = i * 2;
+  }
+  // a few keys are inserted one by one first and rejected by the batch.
+  for (int i = 0; i < count; i += 100) {
+    ASSERT_TRUE(table.Insert(std::move(i), -1));
+  }
+
+  std::unique_ptr<bool[]> inserted(new bool[count]);
+  EXPECT_EQ(static_cast<size_t>(count - count / 100),
+            table.InsertBatch(keys.data(), values.data(), count, inserted.get()));
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(i % 100 != 0, inserted[i]);
+  }
+
+  std::vector<int> lookupKeys(count * 2);
+  for (int i = 0; i < count * 2; i++) {
+    lookupKeys[i] = i;
+  }
+  std::unique_ptr<bool[]> found(new bool[count * 2]);
+  EXPECT_EQ(static_cast<size_t>(count), table.LookupBatch(lookupKeys.data(), count * 2, found.get()));
+
+  std::vector<int> foundValues(count * 2, 0);
+  EXPECT_EQ(static_cast<size_t>(count),
+            table.FindBatch(lookupKeys.data(), count * 2, foundValues.data(), found.get()));
+  for (int i = 0; i < count * 2; i++) {
+    ASSERT_EQ(i < count, found[i]);
+    if (i < count) {
+      EXPECT_EQ(i % 100 == 0 ? -1 : i * 2, foundValues[i]);
+    }
+  }
+}
+
+// std::hash<int> is the identity, keys sharing their low bits must still
+// spread over the table instead of forcing resizes.
+TEST_F(CuckooHasingTableBasicTest, StridedKeysWithIdentityHash) {
+  concurrent_lib::CuckoohashingTable<int, int> table;
+  const size_t size = table.BucketCount();
+  const int count = static_cast<int>(size * decltype(table)::BUCKET_SIZE * 0.85);
+  for (int i = 0; i < count; i++) {
+    int key = i * 4096;
+    ASSERT_TRUE(table.Insert(std::move(key), std::move(i)));
+  }
+
+  EXPECT_EQ(size, table.BucketCount());
+  for (int i = 0; i < count; i++) {
+    EXPECT_EQ(i, table.FindOrDefault(i * 4096, -1));
+  }
+}
+
+// Counts live instances, to check cells are destroyed exactly once when they
+// are erased, moved by cuckoo moves and resizes, or left in the table.
+struct Tracked {
+  static int live;
+  int value;
+
+  Tracked(int v): value(v) { live++; }
+  Tracked(const Tracked& other): value(other.value) { live++; }
+  Tracked(Tracked&& other): value(other.value) { live++; }
+  Tracked& operator=(const Tracked& other) { value = other.value; return *this; }
+  ~Tracked() { live--; }
+};
+int Tracked::live = 0;
+
+TEST_F(CuckooHasingTableBasicTest, CellsAreDestroyed) {
+  {
+    typedef concurrent_lib::CuckoohashingTable<std::string, Tracked> Table;
+    Table table(Table::EAGER, 64);
+    const int count = 5000;
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(table.Insert(std::to_string(i), Tracked(i)));
+    }
+    for (int i = 0; i < count; i += 2) {
+      ASSERT_TRUE(table.Erase(std::to_string(i)));
+    }
+    EXPECT_EQ(count / 2, Tracked::live);
+    for (int i = 1; i < count; i += 2) {
+      ASSERT_TRUE(table.FindFn(std::to_string(i), [i](const Tracked& found) {
+        EXPECT_EQ(i, found.value);
+      }));
+    }
+  }
+  EXPECT_EQ(0, Tracked::live);
+}
+
+struct Blob {
+  Tracked tracked;
+  char data[1024];
+
+  Blob(int v): tracked(v) {
+    std::memset(data, v & 0xff, sizeof(data));
+  }
+
+  int Value() const {
+    return tracked.value;
+  }
+};
+
+// Cuckoo moves and resizes only move pointers to out of line values, which
+// stay where they were allocated until erased.
+TEST_F(CuckooHasingTableBasicTest, OutOfLineValues) {
+  {
+    typedef concurrent_lib::CuckoohashingTable<int, Blob, MixHasher, std::equal_to<int>, 4,
+                                               concurrent_lib::BackoffSpinlock, uint8_t, true> Table;
+    Table table(Table::INCREMENTAL, 64);
+    const int count = 5000;
+    std::vector<const Blob*> addresses(count);
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(table.Insert(std::move(i), Blob(i)));
+      ASSERT_TRUE(table.FindFn(i, [&addresses, i](const Blob& blob) { addresses[i] = &blob; }));
+    }
+    EXPECT_EQ(count, Tracked::live);
+
+    for (int i = 0; i < count; i++) {
+      ASSERT_TRUE(table.FindFn(i, [&addresses, i](const Blob& blob) {
+        EXPECT_EQ(addresses[i], &blob);
+        EXPECT_EQ(i, blob.Value());
+        EXPECT_EQ(static_cast<char>(i & 0xff), blob.data[sizeof(blob.data) - 1]);
+      }));
+    }
+
+    for (int i = 0; i < count; i += 2) {
+      ASSERT_TRUE(table.Erase(i));
+    }
+    EXPECT_EQ(count / 2, Tracked::live);
+    // erased values are reused.
+    for (int i = 0; i < count; i += 2) {
+      int key = count + i;
+      ASSERT_TRUE(table.Insert(std::move(key), Blob(key)));
+    }
+    EXPECT_TRUE(table.UpdateFn(1, [](Blob& blob) { blob.tracked.value = -1; }));
+
+    Table::LockedTable locked = table.LockAll();
+    size_t size = 0;
+    for (auto cell : locked) {
+      EXPECT_EQ(cell.first == 1 ? -1 : cell.first, cell.second.Value());
+      size++;
+    }
+    EXPECT_EQ(static_cast<size_t>(count), size);
+
+    Table::LockedTable::iterator it = locked.begin();
+    const int first = it->first;
+    it->second.tracked.value = -2;
+    EXPECT_EQ(-2, (*it).second.Value());
+    it = locked.Erase(it);
+    EXPECT_NE(first, it->first);
+    EXPECT_EQ(count - 1, Tracked::live);
+  }
+  EXPECT_EQ(0, Tracked::live);
+}
+
+// Moves throw while armed, like a move constructor that allocates.
+struct MayThrow {
+  static bool armed;
+  int value;
+
+  MayThrow(int v): value(v) {}
+  MayThrow(const MayThrow& other): value(other.value) {}
+  MayThrow(MayThrow&& other): value(other.value) {
+    if (armed) {
+      throw std::bad_alloc();
+    }
+  }
+  bool operator==(const MayThrow& other) const { return value == other.value; }
+};
+bool MayThrow::armed = false;
+
+struct MayThrowHasher {
+  size_t operator()(const MayThrow& key) const {
+    return MixHasher()(key.value);
+  }
+};
+
+template <typename Key, typename Value, typename Hasher, bool OUT_OF_LINE_VALUES>
+void InsertThrows() {
+  typedef concurrent_lib::CuckoohashingTable<Key, Value, Hasher, std::equal_to<Key>, 4,
+                                             concurrent_lib::BackoffSpinlock, uint8_t,
+                                             OUT_OF_LINE_VALUES> Table;
+  Table table;
+  const int count = 100;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(Key(i), Value(i)));
+  }
+
+  MayThrow::armed = true;
+  EXPECT_THROW(table.Insert(Key(count), Value(count)), std::bad_alloc);
+  MayThrow::armed = false;
+
+  EXPECT_FALSE(table.Lookup(Key(count)));
+  EXPECT_EQ(static_cast<size_t>(count), table.Size());
+  EXPECT_EQ(static_cast<size_t>(count), table.LockAll().Size());
+  ASSERT_TRUE(table.Insert(Key(count), Value(count)));
+  for (int i = 0; i <= count; i++) {
+    EXPECT_TRUE(table.Lookup(Key(i)));
+  }
+}
+
+// A key or value constructor that throws must leave the slot free.
+TEST_F(CuckooHasingTableBasicTest, InsertThrows) {
+  InsertThrows<MayThrow, int, MayThrowHasher, false>();
+  InsertThrows<int, MayThrow, MixHasher, false>();
+  InsertThrows<MayThrow, int, MayThrowHasher, true>();
+  InsertThrows<int, MayThrow, MixHasher, true>();
+}
+
+// Counts the bytes the table holds through its allocator.
+template <typename T>
+struct CountingAllocator : concurrent_lib::CacheAlignedAllocator<T> {
+  typedef T value_type;
+  template <typename U> struct rebind { typedef CountingAllocator<U> other; };
+
+  long* bytes;
+
+  explicit CountingAllocator(long* b): bytes(b) {}
+
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>& other): bytes(other.bytes) {}
+
+  T* allocate(size_t n) {
+    *bytes += static_cast<long>(n * sizeof(T));
+    return concurrent_lib::CacheAlignedAllocator<T>::allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    *bytes -= static_cast<long>(n * sizeof(T));
+    concurrent_lib::CacheAlignedAllocator<T>::deallocate(p, n);
+  }
+};
+
+TEST_F(CuckooHasingTableBasicTest, CustomAllocator) {
+  long bytes = 0;
+  {
+    typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, 4,
+        concurrent_lib::BackoffSpinlock, uint8_t, false, CountingAllocator<char>> Table;
+    Table table(Table::INCREMENTAL, 64, Table::DEFAULT_MAX_STEP, CountingAllocator<char>(&bytes));
+    EXPECT_GT(bytes, 0);
+    const long initialBytes = bytes;
+    for (int i = 0; i < 10000; i++) {
+      ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+    }
+    EXPECT_GT(bytes, initialBytes);
+    for (int i = 0; i < 10000; i++) {
+      ASSERT_EQ(i, table.FindOrDefault(i, -1));
+    }
+  }
+  EXPECT_EQ(0, bytes);
+}
+
+// Fails the allocation at which *countdown reaches zero, like memory running
+// out in the middle of a resize.
+template <typename T>
+struct FailingAllocator : concurrent_lib::CacheAlignedAllocator<T> {
+  typedef T value_type;
+  template <typename U> struct rebind { typedef FailingAllocator<U> other; };
+
+  int* countdown;
+
+  explicit FailingAllocator(int* c): countdown(c) {}
+
+  template <typename U>
+  FailingAllocator(const FailingAllocator<U>& other): countdown(other.countdown) {}
+
+  T* allocate(size_t n) {
+    if (*countdown > 0 && --*countdown == 0) {
+      throw std::bad_alloc();
+    }
+    return concurrent_lib::CacheAlignedAllocator<T>::allocate(n);
+  }
+};
+
+// A resize that runs out of memory leaves the table as it was, and usable.
+TEST_F(CuckooHasingTableBasicTest, ResizeOutOfMemory) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, 4,
+      concurrent_lib::BackoffSpinlock, uint8_t, false, FailingAllocator<char>> Table;
+  // a resize allocates the lock stripes, the bucket metadata and the cells.
+  for (int failAt = 1; failAt <= 3; failAt++) {
+    int countdown = 0;
+    Table table(Table::INCREMENTAL, 64, Table::DEFAULT_MAX_STEP, FailingAllocator<char>(&countdown));
+    const size_t bucketCount = table.BucketCount();
+
+    countdown = failAt;
+    int inserted = 0;
+    bool threw = false;
+    while (!threw) {
+      int key = inserted;
+      try {
+        ASSERT_TRUE(table.Insert(std::move(key), std::move(key)));
+        inserted++;
+      } catch (const std::bad_alloc&) {
+        threw = true;
+      }
+    }
+
+    EXPECT_EQ(bucketCount, table.BucketCount());
+    EXPECT_EQ(static_cast<size_t>(inserted), table.Size());
+    for (int i = 0; i < inserted; i++) {
+      ASSERT_EQ(i, table.FindOrDefault(i, -1));
+    }
+    const int count = 20000;
+    for (int i = inserted; i < count; i++) {
+      ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+    }
+    EXPECT_EQ(static_cast<size_t>(count), table.Size());
+  }
+}
+
+TEST_F(CuckooHasingTableBasicTest, HugePageAllocator) {
+  concurrent_lib::HugePageAllocator<uint64_t> allocator;
+  const size_t hugePage = concurrent_lib::HugePageAllocator<uint64_t>::HUGE_PAGE_SIZE;
+  for (size_t n : {size_t(100), hugePage / 8, hugePage / 8 * 3 + 5}) {
+    uint64_t* memory = allocator.allocate(n);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(memory) % (n * 8 >= hugePage ? hugePage : 64));
+    for (size_t i = 0; i < n; i++) {
+      memory[i] = i;
+    }
+    EXPECT_EQ(n - 1, memory[n - 1]);
+    allocator.deallocate(memory, n);
+  }
+
+  // 2 MB of cells, the table grows into larger mappings.
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, 4,
+      concurrent_lib::BackoffSpinlock, uint8_t, false, concurrent_lib::HugePageAllocator<char>> Table;
+  Table table(Table::EAGER, 1 << 18);
+  const size_t initSize = table.BucketCount();
+  const int count = 1 << 19;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+  EXPECT_GT(table.BucketCount(), initSize);
+  for (int i = 0; i < count; i++) {
+    ASSERT_EQ(i, table.FindOrDefault(i, -1));
+  }
+}
+
+TEST_F(CuckooHasingTableBasicTest, NumaTopology) {
+  const concurrent_lib::NumaTopology& system = concurrent_lib::NumaTopology::System();
+  EXPECT_FALSE(system.IfSimulated());
+  EXPECT_GE(system.GetNodeNum(), 1u);
+  EXPECT_LT(system.CurrentNode(), system.GetNodeNum());
+
+  concurrent_lib::NumaTopology simulated(2, 8);
+  EXPECT_TRUE(simulated.IfSimulated());
+  EXPECT_EQ(2u, simulated.GetNodeNum());
+  EXPECT_EQ(0u, simulated.NodeOfCpu(3));
+  EXPECT_EQ(1u, simulated.NodeOfCpu(4));
+  EXPECT_EQ(1u, simulated.NodeOfCpu(15));
+  EXPECT_EQ(2u, simulated.GetNodes().size());
+}
+
+// Node ids read from sysfs may have holes, node 1 is offline here.
+TEST_F(CuckooHasingTableBasicTest, NumaTopologyWithHoles) {
+  char dir[] = "/tmp/cuckoo_numa_XXXXXX";
+  ASSERT_NE(nullptr, mkdtemp(dir));
+  const std::string nodeDir(dir);
+  const std::vector<std::pair<std::string, std::string>> files = {
+      {"/online", "0,2-3\n"}, {"/node0/cpulist", "0-1,4\n"},
+      {"/node2/cpulist", "2\n"}, {"/node3/cpulist", "3,5-6\n"}};
+  for (const auto& file : files) {
+    mkdir((nodeDir + file.first.substr(0, file.first.rfind('/'))).c_str(), 0700);
+    std::ofstream(nodeDir + file.first) << file.second;
+  }
+  concurrent_lib::NumaTopology topology = concurrent_lib::NumaTopology::Read(nodeDir);
+  for (const auto& file : files) {
+    unlink((nodeDir + file.first).c_str());
+  }
+  for (const char* node : {"/node0", "/node2", "/node3", ""}) {
+    rmdir((nodeDir + node).c_str());
+  }
+
+  EXPECT_FALSE(topology.IfSimulated());
+  EXPECT_EQ(4u, topology.GetNodeNum());
+  EXPECT_EQ((std::vector<size_t>{0, 2, 3}), topology.GetNodes());
+  EXPECT_FALSE(topology.IfNodeOnline(1));
+  EXPECT_EQ(0u, topology.NodeOfCpu(4));
+  EXPECT_EQ(2u, topology.NodeOfCpu(2));
+  EXPECT_EQ(3u, topology.NodeOfCpu(6));
+
+  concurrent_lib::ReplicatedCuckoohashingTable<int, int, MixHasher> table(64, topology);
+  ASSERT_EQ(3u, table.GetReplicaNum());
+  EXPECT_TRUE(table.Insert(1, 2));
+  for (size_t node : topology.GetNodes()) {
+    EXPECT_EQ(2, table.GetReplica(node).FindOrDefault(1, -1));
+  }
+  // replicas are mapped by NumaAllocator of their node, node 0 can be bound
+  // to on any machine.
+  for (size_t node : topology.GetNodes()) {
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(&table.GetReplica(node)) % 4096);
+  }
+#if defined(SYS_get_mempolicy)
+  int mode = -1;
+  unsigned long nodeMask = 0;
+  ASSERT_EQ(0, syscall(SYS_get_mempolicy, &mode, &nodeMask, sizeof(nodeMask) * 8 + 1,
+                       &table.GetReplica(0), 2 /* MPOL_F_ADDR */));
+  EXPECT_EQ(2 /* MPOL_BIND */, mode);
+  EXPECT_EQ(1ul, nodeMask);
+#endif
+
+  concurrent_lib::NumaTopology missing = concurrent_lib::NumaTopology::Read(nodeDir);
+  EXPECT_EQ(1u, missing.GetNodeNum());
+  EXPECT_EQ(std::vector<size_t>{0}, missing.GetNodes());
+}
+
+TEST_F(CuckooHasingTableBasicTest, NumaAllocator) {
+  typedef concurrent_lib::NumaAllocator<char> Allocator;
+  const concurrent_lib::NumaTopology& system = concurrent_lib::NumaTopology::System();
+  for (const Allocator& allocator : {Allocator(system), Allocator(system, 0)}) {
+    typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, 4,
+        concurrent_lib::BackoffSpinlock, uint8_t, false, Allocator> Table;
+    Table table(Table::INCREMENTAL, 64, Table::DEFAULT_MAX_STEP, allocator);
+    for (int i = 0; i < 20000; i++) {
+      ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+    }
+    for (int i = 0; i < 20000; i++) {
+      ASSERT_EQ(i, table.FindOrDefault(i, -1));
+    }
+  }
+}
+
+// Every simulated node gets a full replica, writes reach all of them.
+TEST_F(CuckooHasingTableBasicTest, ReplicatedTable) {
+  concurrent_lib::NumaTopology topology(3, 6);
+  concurrent_lib::ReplicatedCuckoohashingTable<int, std::string, MixHasher> table(64, topology);
+  ASSERT_EQ(3u, table.GetReplicaNum());
+
+  const int count = 3000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::to_string(i)));
+  }
+  EXPECT_FALSE(table.Insert(0, std::string("duplicate")));
+  EXPECT_TRUE(table.Update(1, std::string("updated")));
+  EXPECT_TRUE(table.Erase(2));
+  EXPECT_FALSE(table.Erase(count));
+
+  for (size_t node = 0; node < table.GetReplicaNum(); node++) {
+    auto& replica = table.GetReplica(node);
+    EXPECT_EQ("0", replica.FindOrDefault(0, ""));
+    EXPECT_EQ("updated", replica.FindOrDefault(1, ""));
+    EXPECT_FALSE(replica.Lookup(2));
+    for (int i = 3; i < count; i++) {
+      ASSERT_EQ(std::to_string(i), replica.FindOrDefault(i, ""));
+    }
+  }
+  EXPECT_EQ("3", table.FindOrDefault(3, ""));
+  EXPECT_TRUE(table.Find(4).HasValue());
+}
+
+TEST_F(CuckooHasingTableBasicTest, Stats) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher> Table;
+  Table table(Table::INCREMENTAL, 64);
+  EXPECT_EQ(0u, table.Size());
+
+  // counts survive resizes and the growth of the lock table.
+  const int count = 20000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+  for (int i = 0; i < count; i += 4) {
+    ASSERT_TRUE(table.Erase(i));
+  }
+  EXPECT_FALSE(table.Erase(0));
+  const size_t entryNum = count - count / 4;
+  EXPECT_EQ(entryNum, table.Size());
+  EXPECT_EQ(entryNum, table.LockAll().Size());
+
+  Table::TableStats stats = table.Stats();
+  EXPECT_EQ(entryNum, stats.entryNum);
+  EXPECT_EQ(table.BucketCount(), stats.bucketNum);
+  EXPECT_EQ(stats.bucketNum * Table::BUCKET_SIZE, stats.slotNum);
+  EXPECT_DOUBLE_EQ(static_cast<double>(entryNum) / stats.slotNum, stats.loadFactor);
+  EXPECT_GE(stats.bucketBytes, stats.slotNum * sizeof(std::pair<int, int>));
+  EXPECT_GT(stats.lockBytes, 0u);
+  EXPECT_EQ(0u, stats.valueBytes);
+  EXPECT_GT(stats.readerBytes, 0u);
+  EXPECT_EQ(sizeof(table) + stats.bucketBytes + stats.lockBytes + stats.readerBytes, stats.totalBytes);
+  EXPECT_EQ(stats.totalBytes, table.MemoryUsage());
+
+  table.LockAll().Clear();
+  EXPECT_EQ(0u, table.Size());
+
+  typedef concurrent_lib::CuckoohashingTable<int, std::string, MixHasher, std::equal_to<int>, 4,
+      concurrent_lib::BackoffSpinlock, uint8_t, true> OutOfLineTable;
+  OutOfLineTable outOfLine;
+  EXPECT_EQ(0u, outOfLine.Stats().valueBytes);
+  outOfLine.Insert(1, std::string("value"));
+  EXPECT_EQ(1u, outOfLine.Size());
+  EXPECT_GE(outOfLine.Stats().valueBytes, sizeof(std::string));
+}
+
+// 4 byte keys with 8 byte values take 12 bytes per slot instead of 16.
+TEST_F(CuckooHasingTableBasicTest, CompactCells) {
+  typedef concurrent_lib::CuckoohashingTable<uint32_t, uint64_t, std::hash<uint32_t>,
+      std::equal_to<uint32_t>, 4, concurrent_lib::BackoffSpinlock, uint8_t, false,
+      concurrent_lib::CacheAlignedAllocator<char>, true> Table;
+  typedef concurrent_lib::CuckoohashingTable<uint32_t, uint64_t> PairTable;
+  // eager resizes leave no old buckets in the byte counts.
+  Table table(Table::EAGER, 64);
+  PairTable pairTable(PairTable::EAGER, 64);
+
+  const uint32_t count = 20000;
+  for (uint32_t i = 0; i < count; i++) {
+    uint64_t value = uint64_t(i) << 32 | i;
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(value)));
+    ASSERT_TRUE(pairTable.Insert(std::move(i), std::move(value)));
+  }
+  for (uint32_t i = 0; i < count; i += 2) {
+    ASSERT_TRUE(table.Erase(i));
+  }
+  EXPECT_TRUE(table.Update(1, 7));
+  EXPECT_EQ(7u, table.FindOrDefault(1, 0));
+  for (uint32_t i = 3; i < count; i++) {
+    ASSERT_EQ(i % 2 == 0 ? 0 : uint64_t(i) << 32 | i, table.FindOrDefault(i, 0));
+  }
+  EXPECT_EQ(count / 2, table.Size());
+
+  ASSERT_EQ(pairTable.BucketCount(), table.BucketCount());
+  const size_t metaBytes = pairTable.Stats().bucketBytes - table.BucketCount() * 4 * 16;
+  EXPECT_EQ(metaBytes + table.BucketCount() * 4 * 12, table.Stats().bucketBytes);
+
+  Table::LockedTable locked = table.LockAll();
+  size_t seen = 0;
+  for (auto it = locked.begin(); it != locked.end(); ++it) {
+    ASSERT_EQ(1u, it->first % 2);
+    (*it).second = it->first;
+    seen++;
+  }
+  EXPECT_EQ(count / 2, seen);
+  locked.Unlock();
+  EXPECT_EQ(5u, table.FindOrDefault(5, 0));
+}
+
+// Compact cells with out of line values hold a key and a pointer per slot,
+// for large values that are not trivially copyable.
+TEST_F(CuckooHasingTableBasicTest, CompactCellsWithOutOfLineValues) {
+  {
+    typedef concurrent_lib::CuckoohashingTable<uint32_t, Blob, std::hash<uint32_t>,
+        std::equal_to<uint32_t>, 4, concurrent_lib::BackoffSpinlock, uint8_t, true,
+        concurrent_lib::CacheAlignedAllocator<char>, true> Table;
+    typedef concurrent_lib::CuckoohashingTable<uint32_t, Blob, std::hash<uint32_t>,
+        std::equal_to<uint32_t>, 4, concurrent_lib::BackoffSpinlock, uint8_t, true> PairTable;
+    Table table(Table::INCREMENTAL, 64);
+    PairTable pairTable(PairTable::EAGER, 64);
+
+    const uint32_t count = 5000;
+    std::vector<const Blob*> addresses(count);
+    for (uint32_t i = 0; i < count; i++) {
+      ASSERT_TRUE(table.Insert(std::move(i), Blob(i)));
+      ASSERT_TRUE(table.FindFn(i, [&addresses, i](const Blob& blob) { addresses[i] = &blob; }));
+    }
+    EXPECT_EQ(static_cast<int>(count), Tracked::live);
+    for (uint32_t i = 0; i < count; i += 2) {
+      ASSERT_TRUE(table.Erase(i));
+    }
+    EXPECT_EQ(static_cast<int>(count / 2), Tracked::live);
+    EXPECT_TRUE(table.UpdateFn(1, [](Blob& blob) { blob.tracked.value = -1; }));
+    for (uint32_t i = 3; i < count; i += 2) {
+      ASSERT_TRUE(table.FindFn(i, [&addresses, i](const Blob& blob) {
+        EXPECT_EQ(addresses[i], &blob);
+        EXPECT_EQ(static_cast<int>(i), blob.Value());
+        EXPECT_EQ(static_cast<char>(i & 0xff), blob.data[sizeof(blob.data) - 1]);
+      }));
+    }
+    EXPECT_EQ(count / 2, table.Size());
+
+    Table::LockedTable locked = table.LockAll();
+    size_t seen = 0;
+    for (auto cell : locked) {
+      EXPECT_EQ(cell.first == 1 ? -1 : static_cast<int>(cell.first), cell.second.Value());
+      seen++;
+    }
+    EXPECT_EQ(count / 2, seen);
+    locked.Unlock();
+
+    // a slot holds 4 bytes of key and 8 of pointer instead of a 16 byte pair.
+    for (uint32_t i = 0; i < count; i++) {
+      ASSERT_TRUE(pairTable.Insert(std::move(i), Blob(i)));
+    }
+    Table eagerTable(Table::EAGER, 64);
+    for (uint32_t i = 0; i < count; i++) {
+      ASSERT_TRUE(eagerTable.Insert(std::move(i), Blob(i)));
+    }
+    ASSERT_EQ(pairTable.BucketCount(), eagerTable.BucketCount());
+    const size_t metaBytes = pairTable.Stats().bucketBytes - pairTable.BucketCount() * 4 * 16;
+    EXPECT_EQ(metaBytes + eagerTable.BucketCount() * 4 * 12, eagerTable.Stats().bucketBytes);
+  }
+  EXPECT_EQ(0, Tracked::live);
+}
@@ -0,0 +1,474 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "CuckoohashingTable.h"
+
+class CuckooHasingTableConcurrentTest : public ::testing::Test { };
+
+struct MixHasher {
+  size_t operator()(int key) const {
+    return static_cast<size_t>(key) * 0x9E3779B97F4A7C15ULL;
+  }
+};
+
+TEST_F(CuckooHasingTableConcurrentTest, ConcurrentInsert) {
+  concurrent_lib::CuckoohashingTable<int, int, MixHasher> table;
+  const int threadNum = 4;
+  const int perThread = static_cast<int>(table.BucketCount() * decltype(table)::BUCKET_SIZE * 0.85) / threadNum;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table, t, perThread]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        int key = i;
+        int value = i;
+        EXPECT_TRUE(table.Insert(std::move(key), std::move(value)));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int i = 0; i < threadNum * perThread; i++) {
+    EXPECT_TRUE(table.Lookup(i));
+  }
+}
+
+typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher> MixTable;
+
+class CuckooHasingTableResizeTest
+    : public ::testing::TestWithParam<MixTable::MigrationMode> { };
+
+TEST_P(CuckooHasingTableResizeTest, LookupDuringResize) {
+  MixTable table(GetParam());
+  const int initCount = 1000;
+  for (int i = 0; i < initCount; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+  }
+
+  const int threadNum = 2;
+  const int perThread = static_cast<int>(table.BucketCount() * decltype(table)::BUCKET_SIZE * 4) / threadNum;
+  std::atomic<int> writers(threadNum);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table, &writers, t, perThread]() {
+      for (int i = initCount + t * perThread; i < initCount + (t + 1) * perThread; i++) {
+        int key = i;
+        int value = i;
+        EXPECT_TRUE(table.Insert(std::move(key), std::move(value)));
+      }
+      writers--;
+    });
+  }
+
+  // keys inserted before the resize are always visible.
+  threads.emplace_back([&table, &writers]() {
+    while (writers.load() > 0) {
+      for (int i = 0; i < initCount; i++) {
+        EXPECT_TRUE(table.Lookup(i));
+      }
+    }
+  });
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int i = 0; i < initCount + threadNum * perThread; i++) {
+    EXPECT_TRUE(table.Lookup(i));
+  }
+}
+
+// A tiny table starts with a lock table as small as itself, which grows with
+// the table while other threads insert.
+TEST_P(CuckooHasingTableResizeTest, ConcurrentInsertFromTinyTable) {
+  MixTable table(GetParam(), 2);
+  const int threadNum = 4;
+  const int perThread = 20000;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table, t, perThread]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+        ASSERT_EQ(i, table.FindOrDefault(i, -1));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int i = 0; i < threadNum * perThread; i++) {
+    ASSERT_EQ(i, table.FindOrDefault(i, -1));
+  }
+}
+
+// Entry counts stay exact across resizes, lock table growth and cuckoo moves
+// while Size() and Stats() are read meanwhile.
+TEST_P(CuckooHasingTableResizeTest, SizeDuringInsertsAndErases) {
+  MixTable table(GetParam(), 2);
+  const int threadNum = 4;
+  const int perThread = 20000;
+  std::atomic<int> writers(threadNum);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table, &writers, t, perThread]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        EXPECT_TRUE(table.Insert(std::move(i), std::move(i)));
+        if (i % 3 == 0) {
+          EXPECT_TRUE(table.Erase(i));
+        }
+      }
+      writers--;
+    });
+  }
+  threads.emplace_back([&table, &writers, threadNum, perThread]() {
+    while (writers.load() > 0) {
+      EXPECT_LE(table.Size(), static_cast<size_t>(threadNum * perThread));
+      EXPECT_GT(table.Stats().totalBytes, 0u);
+    }
+  });
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const size_t entryNum = threadNum * perThread - (threadNum * perThread + 2) / 3;
+  EXPECT_EQ(entryNum, table.Size());
+  EXPECT_EQ(entryNum, table.Stats().entryNum);
+  EXPECT_EQ(entryNum, table.LockAll().Size());
+}
+
+INSTANTIATE_TEST_CASE_P(MigrationModes, CuckooHasingTableResizeTest,
+                        ::testing::Values(MixTable::EAGER, MixTable::INCREMENTAL));
+
+TEST_F(CuckooHasingTableConcurrentTest, ConcurrentUpsert) {
+  MixTable table;
+  const int threadNum = 4;
+  const int keyNum = 5000;
+  const int rounds = 3;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table]() {
+      for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < keyNum; i++) {
+          int key = i;
+          table.Upsert(std::move(key), [](int& v) { v++; }, 1);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int i = 0; i < keyNum; i++) {
+    EXPECT_EQ(threadNum * rounds, table.FindOrDefault(i, 0));
+  }
+}
+
+// Lookups of int keys run without locks, they must never miss a key that is
+// in the table while writers move cells around.
+TEST_F(CuckooHasingTableConcurrentTest, OptimisticLookupDuringWrites) {
+  MixTable table(MixTable::INCREMENTAL);
+  const int stableNum = 2000;
+  for (int i = 0; i < stableNum; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), i * 3));
+  }
+
+  std::atomic<bool> done(false);
+  std::thread writer([&table, &done]() {
+    for (int round = 0; round < 4; round++) {
+      for (int i = stableNum; i < stableNum * 4; i++) {
+        int key = i;
+        table.Insert(std::move(key), std::move(key));
+      }
+      for (int i = stableNum; i < stableNum * 4; i++) {
+        table.Erase(i);
+      }
+    }
+    done = true;
+  });
+
+  std::thread reader([&table, &done]() {
+    while (!done.load()) {
+      for (int i = 0; i < stableNum; i++) {
+        int value = -1;
+        EXPECT_TRUE(table.Find(i, value));
+        EXPECT_EQ(i * 3, value);
+      }
+    }
+  });
+
+  writer.join();
+  reader.join();
+}
+
+// std::string values are read under shared locks, many readers of the same
+// few keys run while a writer keeps updating their neighbours and growing the table.
+TEST_F(CuckooHasingTableConcurrentTest, SharedLookupOfHotKeys) {
+  concurrent_lib::CuckoohashingTable<int, std::string, MixHasher> table;
+  const int hotNum = 8;
+  for (int i = 0; i < hotNum; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), std::to_string(i)));
+  }
+
+  std::atomic<bool> done(false);
+  std::thread writer([&table, &done, hotNum]() {
+    for (int i = hotNum; i < 20000; i++) {
+      int key = i;
+      table.Insert(std::move(key), std::to_string(i));
+      table.Update(i, std::string("updated"));
+    }
+    done = true;
+  });
+
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.emplace_back([&table, &done, hotNum]() {
+      while (!done.load()) {
+        for (int i = 0; i < hotNum; i++) {
+          EXPECT_TRUE(table.FindFn(i, [i](const std::string& value) {
+            EXPECT_EQ(std::to_string(i), value);
+          }));
+        }
+      }
+    });
+  }
+
+  writer.join();
+  for (auto& reader : readers) {
+    reader.join();
+  }
+}
+
+// Full scans see every key inserted before them and never a torn table,
+// while writers keep growing it with incremental migration.
+TEST_F(CuckooHasingTableConcurrentTest, LockedScanDuringInserts) {
+  MixTable table(MixTable::INCREMENTAL, 64);
+  const int threadNum = 3;
+  const int perThread = 20000;
+  std::atomic<int> finished(0);
+
+  std::vector<std::thread> writers;
+  for (int t = 0; t < threadNum; t++) {
+    writers.emplace_back([&table, &finished, t, perThread]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        int key = i;
+        EXPECT_TRUE(table.Insert(std::move(key), std::move(key)));
+      }
+      finished++;
+    });
+  }
+
+  size_t lastSize = 0;
+  while (finished.load() < threadNum) {
+    auto locked = table.LockAll();
+    size_t size = 0;
+    for (const auto& cell : locked) {
+      EXPECT_EQ(cell.first, cell.second);
+      size++;
+    }
+    EXPECT_EQ(size, locked.Size());
+    EXPECT_GE(size, lastSize);
+    lastSize = size;
+    locked.Unlock();
+    // a scan stops every writer, leave them some time in between.
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+
+  EXPECT_EQ(static_cast<size_t>(threadNum * perThread), table.LockAll().Size());
+}
+
+// Values are changed in place while other threads update and look up the
+// same keys. Updates never move keys, so each scan visits every key once.
+TEST_F(CuckooHasingTableConcurrentTest, ParallelForEachDuringUpdates) {
+  MixTable table;
+  const int count = 20000;
+  for (int i = 0; i < count; i++) {
+    ASSERT_TRUE(table.Insert(std::move(i), 0));
+  }
+
+  std::atomic<bool> done(false);
+  std::thread updater([&table, &done, count]() {
+    while (!done.load()) {
+      for (int i = 0; i < count; i++) {
+        EXPECT_TRUE(table.UpdateFn(i, [](int& value) { value++; }));
+      }
+    }
+  });
+  std::thread reader([&table, &done, count]() {
+    while (!done.load()) {
+      for (int i = 0; i < count; i++) {
+        EXPECT_TRUE(table.Lookup(i));
+      }
+    }
+  });
+
+  const int scanNum = 20;
+  for (int round = 0; round < scanNum; round++) {
+    std::vector<int> visits(count, 0);
+    table.ParallelForEach([&visits](const int& key, int& value) {
+      // each key is visited by one thread only.
+      visits[key]++;
+      value += 1000000;
+    }, 4);
+    ASSERT_EQ(std::vector<int>(count, 1), visits);
+  }
+  done = true;
+  updater.join();
+  reader.join();
+
+  for (int i = 0; i < count; i++) {
+    EXPECT_LE(scanNum * 1000000, table.FindOrDefault(i, -1));
+  }
+}
+
+template <typename LockType>
+class CuckooHasingTableLockTest : public ::testing::Test { };
+
+typedef ::testing::Types<concurrent_lib::Spinlock,
+                         concurrent_lib::TTASSpinlock,
+                         concurrent_lib::BackoffSpinlock,
+                         concurrent_lib::Mutexlock,
+                         concurrent_lib::MCSLock,
+                         concurrent_lib::CLHLock,
+                         concurrent_lib::FutexLock,
+                         concurrent_lib::ElidedSpinlock> LockTypes;
+TYPED_TEST_CASE(CuckooHasingTableLockTest, LockTypes);
+
+TYPED_TEST(CuckooHasingTableLockTest, MutualExclusion) {
+  // every increment holds locks[0], sometimes with all other locks like a
+  // resize does.
+  const int lockNum = 8;
+  std::vector<TypeParam> locks(lockNum);
+  const int threadNum = 4;
+  const int rounds = 20000;
+  long counter = 0;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&locks, &counter, rounds]() {
+      for (int i = 0; i < rounds; i++) {
+        if (i % 100 == 0) {
+          for (auto& lock : locks) {
+            lock.lock();
+          }
+          counter++;
+          for (auto& lock : locks) {
+            lock.unlock();
+          }
+        } else if (i % 3 == 0) {
+          while (!locks[0].try_lock());
+          counter++;
+          locks[0].unlock();
+        } else {
+          locks[0].lock();
+          counter++;
+          locks[0].unlock();
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(threadNum * rounds, counter);
+}
+
+TYPED_TEST(CuckooHasingTableLockTest, ConcurrentInsert) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, 4, TypeParam> Table;
+  Table table(Table::EAGER, 64);
+  const int threadNum = 4;
+  const int perThread = 10000;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table, t, perThread]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        ASSERT_TRUE(table.Insert(std::move(i), std::move(i)));
+        ASSERT_EQ(i, table.FindOrDefault(i, -1));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int i = 0; i < threadNum * perThread; i++) {
+    ASSERT_EQ(i, table.FindOrDefault(i, -1));
+  }
+}
+
+TEST_F(CuckooHasingTableConcurrentTest, ElidedSpinlockTransactions) {
+  if (!concurrent_lib::RtmSupported()) {
+    std::cout << "[  SKIPPED ] ElidedSpinlockTransactions: this CPU has no RTM" << std::endl;
+    return;
+  }
+
+  // an uncontended lock is elided, unless the transaction aborts for
+  // reasons of its own, LockNotElided() takes it for real.
+  concurrent_lib::ElidedSpinlock lock;
+  bool elided = false;
+  for (int i = 0; i < 100 && !elided; i++) {
+    lock.lock();
+    elided = concurrent_lib::RtmActive();
+    lock.unlock();
+  }
+  EXPECT_TRUE(elided);
+  lock.LockNotElided();
+  EXPECT_FALSE(concurrent_lib::RtmActive());
+  EXPECT_FALSE(lock.try_lock());
+  lock.unlock();
+}
+
+// Critical sections run as transactions with RTM and on the fallback lock
+// without it, while scans hold many stripes without elision.
+TEST_F(CuckooHasingTableConcurrentTest, ElidedStripes) {
+  typedef concurrent_lib::CuckoohashingTable<int, int, MixHasher, std::equal_to<int>, 4,
+                                             concurrent_lib::ElidedSpinlock> Table;
+  Table table(Table::INCREMENTAL, 64);
+  const int threadNum = 4;
+  const int perThread = 20000;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadNum; t++) {
+    threads.emplace_back([&table, t, perThread]() {
+      for (int i = t * perThread; i < (t + 1) * perThread; i++) {
+        EXPECT_TRUE(table.Insert(std::move(i), std::move(i)));
+        EXPECT_EQ(i, table.FindOrDefault(i, -1));
+        if (i % 2 == 0) {
+          EXPECT_TRUE(table.Erase(i));
+        }
+      }
+    });
+  }
+  threads.emplace_back([&table]() {
+    for (int i = 0; i < 20; i++) {
+      table.ParallelForEach([](const int& key, int& value) {
+        EXPECT_EQ(key, value);
+      }, 2);
+      EXPECT_LE(table.LockAll().Size(), static_cast<size_t>(threadNum * perThread));
+    }
+  });
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(static_cast<size_t>(threadNum * perThread / 2), table.Size());
+  for (int i = 0; i < threadNum * perThread; i++) {
+    ASSERT_EQ(i % 2 == 0 ? -1 : i, table.FindOrDefault(i, -1));
+  }
+}